@@ -2,6 +2,7 @@
 #include "io.h"
 #include "transport.h"
 #include <arpa/inet.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,13 +10,56 @@
 #include <unistd.h>
 
 int main(int argc, char** argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: client <hostname> <port> \n");
+    // Parse options
+    int paths = 1;
+    int lifetime_ms = 0, max_retransmits = -1;
+    bool messages = false;
+    int n_streams = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:CzFm:M:R:n:U")) != -1) {
+        switch (opt) {
+        case 'f': // parity packet per k data packets, or "auto"
+            set_fec(strcmp(optarg, "auto") == 0 ? FEC_ADAPTIVE : atoi(optarg));
+            break;
+        case 'C': // no end-to-end checksums
+            set_checksum(false);
+            break;
+        case 'z': // compress streams if the peer agrees
+            set_compression(true);
+            break;
+        case 'F': // fast open: data in the SYN with a cookie from an earlier connection
+            set_fast_open(true);
+            break;
+        case 'm': // stripe over this many paths: ports <port> .. <port>+paths-1
+            paths = atoi(optarg);
+            break;
+        case 'n': // independently ordered streams; each line of input goes on one
+            n_streams = atoi(optarg);
+            break;
+        case 'U': // UDP only: no shared memory with a same-host peer
+            set_shared_memory(false);
+            break;
+        case 'M': // message mode: give up on a line not ACKed within this many ms
+            lifetime_ms = atoi(optarg);
+            messages = true;
+            break;
+        case 'R': // message mode: give up on a line after this many retransmissions
+            max_retransmits = atoi(optarg);
+            messages = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: client [-f <k|auto>] [-C] [-z] [-F] [-m paths] [-M ms] [-R n] [-n streams] [-U] <hostname> <port> \n");
+            exit(1);
+        }
+    }
+
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: client [-f <k|auto>] [-C] [-z] [-F] [-m paths] [-M ms] [-R n] [-n streams] [-U] <hostname> <port> \n");
         exit(1);
     }
 
-    char* addr = strcmp(argv[1], "localhost") == 0 ? "127.0.0.1" : argv[1];
-    int port = atoi(argv[2]);  
+    char* addr = strcmp(argv[optind], "localhost") == 0 ? "127.0.0.1" : argv[optind];
+    int port = atoi(argv[optind + 1]);  
 
     // Create socket
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);  // use IPv4 and UDP
@@ -26,8 +70,24 @@ int main(int argc, char** argv) {
     server_addr.sin_addr.s_addr = inet_addr(addr); // inet_addr() converts human-readable address to 32-bit binary 's_addr'
     server_addr.sin_port = htons(port);            // Little -> Big Endian (network order)
 
+    // Every other path gets its own socket (source port) and server port
+    for (int i = 1; i < paths; i++){
+        struct sockaddr_in path_addr = server_addr;
+        path_addr.sin_port = htons(port + i);
+        add_subflow(socket(AF_INET, SOCK_DGRAM, 0), &path_addr);
+    }
+
     init_io();
-    listen_loop(sockfd, &server_addr, CLIENT_START, input_io, output_io);
+    if (messages){ set_message_mode(lifetime_ms, max_retransmits); }
+    if (n_streams > 1){
+        // Every line is one request of its own: it goes on a stream, and a loss
+        // holds back only the lines of that stream
+        listen_loop_streams(sockfd, &server_addr, CLIENT_START, n_streams, input_stream_line, output_stream_line);
+        flush_stream_lines();
+    }
+    else {
+        listen_loop(sockfd, &server_addr, CLIENT_START, messages ? input_message : input_io, output_io);
+    }
 
     return 0;
 }
\ No newline at end of file
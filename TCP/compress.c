@@ -0,0 +1,164 @@
+#include "compress.h"
+#include "consts.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define COMP_BLOCK 16384  // Most input bytes compressed into one frame
+#define FRAME_HEADER 4    // type (1 byte), unused (1 byte), body length (2 bytes)
+#define FRAME_RAW 0
+#define FRAME_DEFLATE 1
+#define MAX_SKIP 64       // Most frames sent raw untried after incompressible data
+
+typedef struct {
+    uint8_t* out;     // Encoded frame being handed to the transport
+    size_t out_len;
+    size_t out_off;
+    int skip;         // Frames left to send raw without trying to compress
+    int backoff;      // Skip count after the next incompressible frame
+    uint8_t* in;      // Partially received frame
+    size_t in_len;
+} comp_stream;
+
+static _Thread_local comp_stream comp[MAX_STREAMS];
+static _Thread_local z_stream deflater;
+static _Thread_local z_stream inflater;
+static _Thread_local size_t max_frame; // FRAME_HEADER + worst-case deflate output of a block
+
+static _Thread_local uint64_t raw_bytes = 0;        // Application bytes sent
+static _Thread_local uint64_t compressed_bytes = 0; // Framed bytes handed to the transport
+
+static _Thread_local ssize_t (*raw_input)(uint16_t, uint8_t*, size_t);
+static _Thread_local void (*raw_output)(uint16_t, uint8_t*, size_t);
+
+void init_compression(ssize_t (*input_p)(uint16_t, uint8_t*, size_t),
+                      void (*output_p)(uint16_t, uint8_t*, size_t)) {
+    raw_input = input_p;
+    raw_output = output_p;
+
+    if (deflateInit(&deflater, Z_BEST_SPEED) != Z_OK || inflateInit(&inflater) != Z_OK) {
+        fprintf(stderr, "[ERROR] Failed to initialize zlib.\n");
+        exit(1);
+    }
+    max_frame = FRAME_HEADER + deflateBound(&deflater, COMP_BLOCK);
+}
+
+// Read one block of input and encode it as the stream's next frame.
+// Returns what the input returned: bytes read, 0 or -1 at end of input.
+static ssize_t fill_frame(uint16_t stream) {
+    comp_stream* cs = &comp[stream];
+    uint8_t block[COMP_BLOCK];
+
+    ssize_t len = raw_input(stream, block, COMP_BLOCK);
+    if (len <= 0) { return len; }
+    raw_bytes += len;
+
+    if (cs->out == NULL) { cs->out = malloc(max_frame); }
+    uint8_t type = FRAME_RAW;
+    size_t body_len = len;
+
+    if (cs->skip > 0) {
+        cs->skip--;
+    } else {
+        deflateReset(&deflater);
+        deflater.next_in = block;
+        deflater.avail_in = len;
+        deflater.next_out = cs->out + FRAME_HEADER;
+        deflater.avail_out = max_frame - FRAME_HEADER;
+        deflate(&deflater, Z_FINISH);
+        size_t deflated = deflater.total_out;
+
+        if (deflated < (size_t) len) {
+            type = FRAME_DEFLATE;
+            body_len = deflated;
+            cs->backoff = 1;
+        } else {
+            // Incompressible: send raw, and back off before trying again
+            cs->skip = cs->backoff;
+            cs->backoff = MIN(cs->backoff * 2, MAX_SKIP);
+        }
+    }
+    if (type == FRAME_RAW) {
+        memcpy(cs->out + FRAME_HEADER, block, len);
+    }
+
+    cs->out[0] = type;
+    cs->out[1] = 0;
+    cs->out[2] = body_len >> 8;
+    cs->out[3] = body_len & 0xff;
+    cs->out_len = FRAME_HEADER + body_len;
+    cs->out_off = 0;
+    compressed_bytes += cs->out_len;
+    return len;
+}
+
+ssize_t compress_input(uint16_t stream, uint8_t* buf, size_t max_length) {
+    comp_stream* cs = &comp[stream];
+    if (cs->out_off == cs->out_len) {
+        ssize_t len = fill_frame(stream);
+        if (len <= 0) { return len; }
+    }
+
+    size_t len = MIN(max_length, cs->out_len - cs->out_off);
+    memcpy(buf, cs->out + cs->out_off, len);
+    cs->out_off += len;
+    return len;
+}
+
+// Decode one complete frame and write it out
+static void output_frame(uint16_t stream, uint8_t* frame, size_t body_len) {
+    if (frame[0] == FRAME_RAW) {
+        raw_output(stream, frame + FRAME_HEADER, body_len);
+        return;
+    }
+
+    uint8_t block[COMP_BLOCK];
+    inflateReset(&inflater);
+    inflater.next_in = frame + FRAME_HEADER;
+    inflater.avail_in = body_len;
+    inflater.next_out = block;
+    inflater.avail_out = COMP_BLOCK;
+    if (inflate(&inflater, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "[ERROR] Corrupt compressed frame on stream %u.\n", stream);
+        exit(1);
+    }
+    raw_output(stream, block, inflater.total_out);
+}
+
+void decompress_output(uint16_t stream, uint8_t* buf, size_t length) {
+    comp_stream* cs = &comp[stream];
+    if (cs->in == NULL) { cs->in = malloc(max_frame); }
+
+    while (length > 0) {
+        // Collect the header first, then the body it announces
+        size_t want = FRAME_HEADER;
+        if (cs->in_len >= FRAME_HEADER) {
+            want += (cs->in[2] << 8) | cs->in[3];
+        }
+
+        size_t take = MIN(length, want - cs->in_len);
+        memcpy(cs->in + cs->in_len, buf, take);
+        cs->in_len += take;
+        buf += take;
+        length -= take;
+
+        if (cs->in_len < FRAME_HEADER) { continue; }
+        size_t frame_len = FRAME_HEADER + ((cs->in[2] << 8) | cs->in[3]);
+        if (frame_len > max_frame) {
+            fprintf(stderr, "[ERROR] Oversized compressed frame on stream %u.\n", stream);
+            exit(1);
+        }
+        if (cs->in_len == frame_len) {
+            output_frame(stream, cs->in, frame_len - FRAME_HEADER);
+            cs->in_len = 0;
+        }
+    }
+}
+
+void print_compression_stats() {
+    if (raw_bytes == 0) { return; }
+    fprintf(stderr, "[INFO] Compressed %lu bytes into %lu bytes (%.2fx).\n",
+            raw_bytes, compressed_bytes, (double) raw_bytes / compressed_bytes);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <unistd.h>
+
+// Optional compression layer between the application and the transport.
+// Each stream is cut into frames of up to COMP_BLOCK input bytes; a frame is
+// deflated on its own, or sent raw when it does not compress.
+
+// Set the application's input/output functions the layer reads from / writes to
+void init_compression(ssize_t (*input_p)(uint16_t, uint8_t*, size_t),
+                      void (*output_p)(uint16_t, uint8_t*, size_t));
+
+// Get compressed stream data to segment (same contract as the input function:
+// 0 if nothing is ready, -1 once the input ended and every frame went out)
+ssize_t compress_input(uint16_t stream, uint8_t* buf, size_t max_length);
+
+// Take in-order compressed stream data, write out decompressed data
+void decompress_output(uint16_t stream, uint8_t* buf, size_t length);
+
+// Report bytes before and after compression
+void print_compression_stats();
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include "timer.h"
 
 // Maximum payload size
 #define MAX_PAYLOAD 1012
@@ -12,14 +13,64 @@
 #define TV_DIFF(end, start)                                                    \
     (end.tv_sec * 1000000) - (start.tv_sec * 1000000) + end.tv_usec -          \
         start.tv_usec
-#define RTO 1000000
+#define RTO 1000000     // Until an RTT is measured; then SRTT + 4 * RTTVAR (RFC 6298)
+#define RTO_MIN 200000  // Floor of the measured retransmission timeout
+#define RTO_MAX 4000000 // Cap of a segment's timeout as it doubles with each retransmission
+#define SYN_RETRIES 5 // SYN / SYN-ACK retransmissions (RTO doubling each time)
+#define LINGER 2         // Timeouts (rto_us()) to stay after close to re-ACK a FIN whose ACK was lost; the peer resends it after one
+#define FIN_RETRIES 2    // FIN retransmissions once the peer has closed too
+#define MAX_RETRIES 8     // Timeout retransmissions of one segment before giving up on the peer
+#define IDLE_TIMEOUT 4000000 // Exit after this long without traffic once buffers are empty
+#define PACE_INTERVAL 10000  // At most one new data packet per interval
+#define TIMER_TICK 1000      // Timer wheel resolution
 #define MIN(a, b) (a > b ? b : a)
 #define MAX(c, d) (c > d ? c : d)
 
+// SEQ#s are 32 bits and wrap around; compare them by their distance (RFC 1982).
+// SEQ# 0 marks a pure ACK, so counting past the wrap skips it.
+#define SEQ_LT(a, b) ((int32_t) ((uint32_t) (a) - (uint32_t) (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t) ((uint32_t) (a) - (uint32_t) (b)) <= 0)
+#define SEQ_GT(a, b) SEQ_LT(b, a)
+#define SEQ_GEQ(a, b) SEQ_LEQ(b, a)
+#define SEQ_ADD(s, n) ((uint32_t) ((s) + (n)) < (uint32_t) (s) ? (uint32_t) ((s) + (n) + 1) : (uint32_t) ((s) + (n)))
+
 // Window size
 #define MIN_WINDOW MAX_PAYLOAD
 #define MAX_WINDOW MAX_PAYLOAD * 40
-#define DUP_ACKS 3
+#define WINDOW_UPDATE (2 * MAX_PAYLOAD) // Window growth advertised right away in a pure ACK
+#define PROBE_MIN 10000 // First window probe timeout (otherwise 2 * SRTT); doubles up to the RTO
+
+// Loss detection (RACK)
+#define SACK_BLOCKS 16 // Most runs of out-of-order packets listed in one pure ACK
+#define REO_WND_DIV 4  // Reordering window: the lowest RTT seen divided by this
+#define TLP_MIN 10000  // Shortest tail loss probe timeout (otherwise 2 * SRTT)
+
+// Streams
+#define MAX_STREAMS 16                    // Streams multiplexed over one connection
+#define STREAM_WINDOW (MAX_WINDOW / 4)    // Per-stream flow credit (unACKed bytes)
+
+// Multipath
+#define MAX_SUBFLOWS 8       // Paths (socket and peer address) one connection stripes data over
+#define JOIN_NONCE_LEN 4     // Nonce in a SYN-ACK with MPATH that a join must carry to open a path
+#define SUBFLOW_INIT_CWND 4  // Packets a new path may have in flight
+#define SUBFLOW_MIN_CWND 2   // Smallest window of a path after losses
+#define SUBFLOW_TIMEOUTS 3   // Retransmission timeouts in a row after which a path is dropped
+
+// Socket buffers
+#define SOCKBUF_PER_PACKET 2304       // Kernel memory charged for one full datagram (its skb)
+#define SOCKBUF_MAX (4 * 1024 * 1024) // Largest receive buffer we grow to after kernel drops
+
+// Shared memory (same-host peers)
+#define SHM_CHUNK 65536 // Most input read into one ring record
+#define SHM_BATCH 64    // Records read or written per loop round
+
+// Forward error correction
+#define FEC_OFF 0           // No parity packets
+#define FEC_ADAPTIVE -1     // Pick the block size from the measured loss rate
+#define FEC_MIN_BLOCK 2     // Smallest block protected by one parity packet
+#define FEC_MAX_BLOCK 16    // Largest block protected by one parity packet
+#define FEC_HIST 64         // Received packets kept to rebuild a lost one
+#define FEC_PARITY 8        // Parity packets kept until their block is complete
 
 // States
 #define SERVER_AWAIT 0    // Server waiting for SYN
@@ -31,6 +82,15 @@
 // Flags
 #define SYN 0b001
 #define ACK 0b010
+#define FEC 0b100 // Parity packet repairing a block of data packets
+#define CSUM 0b1000 // Packet carries a CRC32C in csum (asks for checksums in SYN)
+#define COMP 0b10000 // SYN/SYN-ACK: sender wants stream compression
+#define FASTOPEN 0b100000 // SYN: cookie (+ data) or cookie request; SYN-ACK: cookie
+#define FIN 0b1000000 // Sender has no more data; takes a SEQ# like a data packet
+#define SACK 0b10000000 // Pure ACK: payload lists packets received above the ACK# (sack_block[])
+#define MPATH 0b100000000 // SYN/SYN-ACK: sender opens `subflows` paths; pure ACK: joins the path it arrives on
+#define FORWARD 0b1000000000 // SYN/SYN-ACK: sender understands forward ACK points; otherwise: payload is one (forward_header)
+#define SHM 0b10000000000 // SYN: a same-host client takes a shared-memory channel; SYN-ACK: the server sent it
 
 // Diagnostic messages
 #define RECV 0
@@ -40,20 +100,111 @@
 
 // Structs
 typedef struct {
-    uint16_t seq;
-    uint16_t ack;
+    uint32_t seq;
+    uint32_t ack;
     uint16_t length;
     uint16_t win;
     uint16_t flags; // LSb 0 SYN, LSb 1 ACK
-    uint16_t unused;
+    uint16_t stream; // Stream ID the payload belongs to
+    uint16_t sseq;   // Per-stream sequence number (orders delivery within a stream)
+    uint8_t subflows;  // SYN/SYN-ACK with MPATH: paths the sender opens (0 otherwise)
+    uint8_t streams;   // SYN: streams the client wants; SYN-ACK: streams agreed on (0 otherwise)
+    uint32_t csum;   // CRC32C over header (with csum = 0) and payload, if CSUM is set
     uint8_t payload[0]; // in raw binary data byte
 } packet;
+// The header goes on the wire as is and is checksummed whole: 24 bytes, no padding
+_Static_assert(sizeof(packet) == 24, "packet header has padding");
+
+// Leads the payload of a parity packet; header fields of the block's packets
+// are XORed together so a rebuilt packet gets its own length, stream and sseq
+typedef struct {
+    uint16_t count;    // Number of data packets in the block (SEQ# seq .. seq+count-1)
+    uint16_t length_x; // XOR of payload lengths
+    uint16_t stream_x; // XOR of stream IDs
+    uint16_t sseq_x;   // XOR of per-stream SEQ#s
+} fec_header;
+
+// One run of consecutive packets the receiver holds above its ACK#
+typedef struct {
+    uint32_t start; // First SEQ# of the run
+    uint32_t end;   // One past its last SEQ#
+} sack_block;
+
+// Payload of a FORWARD packet: the sender gave up on every message below
+// `seq` that has not arrived. `count` forward_stream entries follow.
+typedef struct {
+    uint32_t seq;   // New lowest SEQ# the receiver waits for
+    uint16_t count; // Streams with messages given up on
+    uint16_t unused;
+} forward_header;
+
+typedef struct {
+    uint16_t stream;
+    uint16_t sseq;  // Per-stream SEQ# following the last message given up on
+} forward_stream;
+
+// Largest datagram we send or receive
+#define MAX_PACKET (sizeof(packet) + sizeof(fec_header) + MAX_PAYLOAD)
 
 typedef struct buffer_node {
     struct buffer_node* next;
+    bool delivered; // Payload already written out to its stream
+    timer rto;      // Send buffer: retransmission deadline of this segment
+    int retries;    // Send buffer: timeout retransmissions so far
+    uint64_t sent_ns;   // Send buffer: time of the latest (re)transmission
+    bool retransmitted; // Send buffer: sent more than once (no RTT sample)
+    bool sacked;        // Send buffer: the peer holds it, awaiting the cumulative ACK
+    bool lost;          // Send buffer: RACK judged it lost; retransmit next
+    uint8_t subflow;    // Send buffer: path of the latest transmission
+    int retransmits;    // Send buffer: times it was sent again
+    uint64_t expires_ns;    // Send buffer, message mode: give up on it after this (0: never)
+    bool abandoned;     // Send buffer: given up on; the peer is told by a FORWARD packet
+    bool in_flight;     // Send buffer: counted in that path's in_flight
     packet pkt;
 } buffer_node;
 
+typedef struct {
+    uint32_t data_sent;     // New data packets sent
+    uint32_t retransmits;   // Data packets sent again (fast retransmit or timeout)
+    uint32_t fec_sent;      // Parity packets sent
+    uint32_t fec_recovered; // Lost data packets rebuilt from parity
+    uint32_t csum_errors;   // Packets dropped for a bad or missing checksum
+    uint32_t kernel_drops;  // Datagrams the kernel dropped on a full receive queue
+    uint32_t msgs_abandoned; // Messages we gave up on (message mode)
+    uint32_t msgs_skipped;   // Messages the peer gave up on that never arrived
+} transport_stats;
+
+typedef struct {
+    uint16_t next_sseq;     // Per-stream SEQ# for our next outgoing packet
+    uint16_t expected_sseq; // Per-stream SEQ# we deliver next
+    int in_flight;          // Bytes sent on this stream but not yet ACKed
+    int buffered;           // Bytes received on this stream but not yet delivered
+    bool input_done;        // Input reached end of file
+} stream_state;
+
+// One path of a connection: our socket and the peer's address on it, with the
+// RTT, loss detection and window state of the packets sent over it
+typedef struct {
+    int sockfd;
+    struct sockaddr_in addr;  // Peer's address; a server learns it from the first packet
+    bool active;              // Agreed on in the handshake and the peer was heard on it
+    bool bound;               // addr is the peer's: given (client, path 0) or taken from a valid join (server)
+    int join_retries;         // Client: joins sent without an answer
+    timer pace;               // Pending while new data on this path must wait (PACE_INTERVAL)
+    uint64_t srtt_ns;         // Smoothed RTT (0: not measured yet)
+    uint64_t min_rtt_ns;      // Lowest RTT seen; sets the reordering window
+    uint64_t rack_xmit_ns;    // RACK: send time of the latest-sent segment delivered over this path
+    uint32_t rack_end_seq;    // RACK: its SEQ#
+    uint64_t rack_rtt_ns;     // RACK: RTT measured on that segment
+    double cwnd;              // Packets this path may have in flight
+    int in_flight;            // Packets sent on this path and not yet delivered or resent
+    uint64_t recovery_ns;     // Window last cut at this time: losses of older packets do not cut it again
+    int timeouts;             // Retransmission timeouts since a packet on it was last delivered
+    uint32_t packets_sent;
+    int rcvbuf;               // Receive buffer size of the socket (0: unknown)
+    uint32_t rxq_drops;       // Kernel's count of datagrams dropped on the socket's full receive queue
+} subflow;
+
 // Helpers
 static inline void print(char* txt) {
     fprintf(stderr, "%s\n", txt);
@@ -77,9 +228,18 @@ static inline void print_diag(packet* pkt, int diag) {
 
     bool syn = pkt->flags & SYN;
     bool ack = pkt->flags & ACK;
-    fprintf(stderr, " %hu ACK %hu LEN %hu WIN %hu FLAGS ", ntohs(pkt->seq),
-            ntohs(pkt->ack), ntohs(pkt->length), ntohs(pkt->win));
-    if (!syn && !ack) {
+    bool fec = pkt->flags & FEC;
+    bool csum = pkt->flags & CSUM;
+    bool comp = pkt->flags & COMP;
+    bool fastopen = pkt->flags & FASTOPEN;
+    bool fin = pkt->flags & FIN;
+    bool sack = pkt->flags & SACK;
+    bool mpath = pkt->flags & MPATH;
+    bool forward = pkt->flags & FORWARD;
+    bool shm = pkt->flags & SHM;
+    fprintf(stderr, " %u ACK %u LEN %hu WIN %hu STREAM %hu FLAGS ", ntohl(pkt->seq),
+            ntohl(pkt->ack), ntohs(pkt->length), ntohs(pkt->win), ntohs(pkt->stream));
+    if (!syn && !ack && !fec && !csum && !comp && !fastopen && !fin && !sack && !mpath && !forward && !shm) {
         fprintf(stderr, "NONE");
     } else {
         if (syn) {
@@ -88,6 +248,33 @@ static inline void print_diag(packet* pkt, int diag) {
         if (ack) {
             fprintf(stderr, "ACK ");
         }
+        if (fec) {
+            fprintf(stderr, "FEC ");
+        }
+        if (csum) {
+            fprintf(stderr, "CSUM ");
+        }
+        if (comp) {
+            fprintf(stderr, "COMP ");
+        }
+        if (fastopen) {
+            fprintf(stderr, "FASTOPEN ");
+        }
+        if (fin) {
+            fprintf(stderr, "FIN ");
+        }
+        if (sack) {
+            fprintf(stderr, "SACK ");
+        }
+        if (mpath) {
+            fprintf(stderr, "MPATH ");
+        }
+        if (forward) {
+            fprintf(stderr, "FORWARD ");
+        }
+        if (shm) {
+            fprintf(stderr, "SHM ");
+        }
     }
     fprintf(stderr, "\n");
 }
@@ -105,7 +292,7 @@ static inline void print_buf(buffer_node* node, int diag) {
     }
 
     while (node != NULL) {
-        fprintf(stderr, "%hu ", htons(node->pkt.seq));
+        fprintf(stderr, "%u ", ntohl(node->pkt.seq));
         node = node->next;
     }
     fprintf(stderr, "\n");
@@ -0,0 +1,185 @@
+#include "crc32c.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#define POLY 0x82f63b78 // CRC32C polynomial, bit-reflected
+
+#define LANE 64   // Bytes per lane when three lanes are checksummed side by side
+#define WIDE_LANE 256 // Lane of the PCLMUL kernel, merged by multiplication instead of tables
+
+static uint32_t table[8][256]; // Slicing-by-8 tables
+static uint32_t shift[4][256]; // CRC state advanced over LANE zero bytes, per state byte
+static uint64_t wide_shift[2]; // x^(8n - 33) mod P for n = 2 and 1 WIDE_LANE bytes, see crc32c_clmul()
+static bool table_ready = false;
+
+static void init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i << (8 * k);
+            for (int n = 0; n < LANE; n++) {
+                crc = (crc >> 8) ^ table[0][crc & 0xff];
+            }
+            shift[k][i] = crc;
+        }
+    }
+    for (int k = 0; k < 2; k++) {
+        uint32_t crc = 0x80000000; // x^0, bit-reflected
+        for (int n = 0; n < 8 * WIDE_LANE * (2 - k) - 33; n++) {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1; // times x
+        }
+        wide_shift[k] = crc;
+    }
+    table_ready = true;
+}
+
+// The CRC state is linear, so the state after LANE more bytes is the shifted
+// state XOR the CRC of those bytes alone
+static inline uint32_t shift_lane(uint32_t crc) {
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^
+           shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void* buf, size_t len) {
+    if (!table_ready) { init_table(); }
+
+    const uint8_t* p = buf;
+    crc = ~crc;
+
+    // Byte at a time up to 8-byte alignment, then 8 bytes per step
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc; // little-endian: low 4 bytes meet the running CRC
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+              table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+              table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// crc32 instructions have a 3-cycle latency but issue every cycle, so three
+// independent lanes are run side by side and merged with shift_lane()
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void* buf, size_t len) {
+    const uint8_t* p = buf;
+    uint64_t crc64 = ~crc;
+
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc64 = _mm_crc32_u8((uint32_t) crc64, *p++);
+        len--;
+    }
+    while (len >= 3 * LANE) {
+        uint64_t crc_b = 0;
+        uint64_t crc_c = 0;
+        for (int i = 0; i < LANE; i += 8) {
+            uint64_t a, b, c;
+            memcpy(&a, p + i, 8);
+            memcpy(&b, p + LANE + i, 8);
+            memcpy(&c, p + 2 * LANE + i, 8);
+            crc64 = _mm_crc32_u64(crc64, a);
+            crc_b = _mm_crc32_u64(crc_b, b);
+            crc_c = _mm_crc32_u64(crc_c, c);
+        }
+        crc64 = shift_lane(shift_lane((uint32_t) crc64) ^ (uint32_t) crc_b) ^ (uint32_t) crc_c;
+        p += 3 * LANE;
+        len -= 3 * LANE;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc64 = _mm_crc32_u8((uint32_t) crc64, *p++);
+        len--;
+    }
+    return ~(uint32_t) crc64;
+}
+
+// Same three lanes, but WIDE_LANE long: the carry-less product of a lane's CRC
+// and x^(8n - 33) is that CRC advanced over n bytes, once crc32 has reduced it
+// (the 33 makes up for the x^32 crc32 multiplies in and the one clmul adds),
+// so two multiplies replace the eight table lookups of each merge
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_clmul(uint32_t crc, const void* buf, size_t len) {
+    const uint8_t* p = buf;
+    uint64_t crc64 = ~crc;
+
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc64 = _mm_crc32_u8((uint32_t) crc64, *p++);
+        len--;
+    }
+    __m128i k = _mm_set_epi64x(wide_shift[1], wide_shift[0]);
+    while (len >= 3 * WIDE_LANE) {
+        uint64_t crc_b = 0;
+        uint64_t crc_c = 0;
+        for (int i = 0; i < WIDE_LANE; i += 8) {
+            uint64_t a, b, c;
+            memcpy(&a, p + i, 8);
+            memcpy(&b, p + WIDE_LANE + i, 8);
+            memcpy(&c, p + 2 * WIDE_LANE + i, 8);
+            crc64 = _mm_crc32_u64(crc64, a);
+            crc_b = _mm_crc32_u64(crc_b, b);
+            crc_c = _mm_crc32_u64(crc_c, c);
+        }
+        __m128i a_b = _mm_set_epi64x(crc_b, (uint32_t) crc64);
+        __m128i prod = _mm_xor_si128(_mm_clmulepi64_si128(a_b, k, 0x00), _mm_clmulepi64_si128(a_b, k, 0x11));
+        crc64 = crc_c ^ _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+        p += 3 * WIDE_LANE;
+        len -= 3 * WIDE_LANE;
+    }
+    return crc32c_hw(~(uint32_t) crc64, p, len);
+}
+#endif
+
+static uint32_t crc32c_dispatch(uint32_t crc, const void* buf, size_t len);
+
+// Resolved on first call to the best kernel for this CPU
+static uint32_t (*crc32c_impl)(uint32_t, const void*, size_t) = crc32c_dispatch;
+
+static uint32_t crc32c_dispatch(uint32_t crc, const void* buf, size_t len) {
+    if (!table_ready) { init_table(); }
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = __builtin_cpu_supports("pclmul") ? crc32c_clmul : crc32c_hw;
+    }
+#endif
+    return crc32c_impl(crc, buf, len);
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+    return crc32c_impl(crc, buf, len);
+}
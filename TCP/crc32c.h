@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of buf, continuing from crc (pass 0 to start).
+// Uses the SSE4.2 crc32 instruction (merged with PCLMUL if present) when the
+// CPU has it, a table otherwise.
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+// Table-driven CRC32C, always available (used as fallback and for testing)
+uint32_t crc32c_sw(uint32_t crc, const void* buf, size_t len);
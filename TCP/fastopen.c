@@ -0,0 +1,214 @@
+#include "fastopen.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint8_t secret[16];
+static bool secret_loaded = false;
+
+// SipHash-2-4: a keyed hash, so a cookie for one address says nothing about
+// the cookie for another
+#define ROTL(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                                               \
+    do {                                                                       \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);             \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                                 \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                                 \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);             \
+    } while (0)
+
+static uint64_t siphash24(const uint8_t key[16], const uint8_t* in, size_t len) {
+    uint64_t k0, k1;
+    memcpy(&k0, key, 8);
+    memcpy(&k1, key + 8, 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t m;
+        memcpy(&m, in + i, 8);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    uint64_t b = (uint64_t) len << 56;
+    for (size_t j = 0; i + j < len; j++) {
+        b |= (uint64_t) in[i + j] << (8 * j);
+    }
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Make dir (mode 0700) unless it exists; either way it must be a real
+// directory of ours that nobody else can get into
+static bool private_dir(const char* dir) {
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) { return false; }
+    struct stat st;
+    return lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 077) == 0;
+}
+
+// Full path of one of our files; false if there is no private place for it
+static bool fastopen_path(const char* name, char* path, size_t size) {
+    char base[256];
+    const char* cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (cache != NULL && cache[0] == '/') {
+        snprintf(base, sizeof(base), "%s", cache);
+    }
+    else if (home != NULL && home[0] == '/') {
+        snprintf(base, sizeof(base), "%s/.cache", home);
+        mkdir(base, 0700); // may be shared with other programs: only ours below must be private
+    }
+    else {
+        return false;
+    }
+    int n = snprintf(path, size, "%s/" FASTOPEN_DIR, base);
+    if (n < 0 || (size_t) n >= size || !private_dir(path)) {
+        fprintf(stderr, "[INFO] No private directory for fast open state at %s.\n", path);
+        return false;
+    }
+    n = snprintf(path, size, "%s/" FASTOPEN_DIR "/%s", base, name);
+    return n > 0 && (size_t) n < size;
+}
+
+// Open one of our files, refusing symlinks and anything not private to us
+static int open_private(const char* path, int flags) {
+    int fd = open(path, flags | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) { return -1; }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+    return fd;
+}
+
+// Read the server secret, creating it on first use
+static void load_secret() {
+    if (secret_loaded) { return; }
+
+    char path[512];
+    bool have_path = fastopen_path(FASTOPEN_SECRET_FILE, path, sizeof(path));
+    int fd = have_path ? open_private(path, O_RDONLY) : -1;
+    if (fd < 0 || read(fd, secret, sizeof(secret)) != sizeof(secret)) {
+        if (fd >= 0) { close(fd); }
+        int rfd = open("/dev/urandom", O_RDONLY);
+        if (rfd < 0 || read(rfd, secret, sizeof(secret)) != sizeof(secret)) {
+            fprintf(stderr, "[ERROR] Failed to generate fast open secret.\n");
+            exit(1);
+        }
+        close(rfd);
+        fd = -1;
+        if (have_path) {
+            unlink(path); // a short or foreign file; never write through it
+            fd = open_private(path, O_WRONLY | O_CREAT | O_EXCL);
+        }
+        if (fd < 0 || write(fd, secret, sizeof(secret)) != sizeof(secret)) {
+            fprintf(stderr, "[INFO] Could not save fast open secret; cookies last one run.\n");
+        }
+    }
+    if (fd >= 0) { close(fd); }
+    secret_loaded = true;
+}
+
+void fastopen_cookie(struct sockaddr_in* client, uint8_t* cookie) {
+    load_secret();
+    uint64_t mac = siphash24(secret, (uint8_t*) &client->sin_addr.s_addr, sizeof(client->sin_addr.s_addr));
+    memcpy(cookie, &mac, COOKIE_LEN);
+}
+
+bool fastopen_cookie_valid(struct sockaddr_in* client, const uint8_t* cookie) {
+    uint8_t expected[COOKIE_LEN];
+    fastopen_cookie(client, expected);
+    return memcmp(cookie, expected, COOKIE_LEN) == 0;
+}
+
+static void server_key(struct sockaddr_in* server, char* key, size_t size) {
+    snprintf(key, size, "%s:%u", inet_ntoa(server->sin_addr), ntohs(server->sin_port));
+}
+
+bool fastopen_load_cookie(struct sockaddr_in* server, uint8_t* cookie) {
+    char path[512];
+    if (!fastopen_path(FASTOPEN_CACHE_FILE, path, sizeof(path))) { return false; }
+    int fd = open_private(path, O_RDONLY);
+    FILE* f = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (f == NULL) {
+        if (fd >= 0) { close(fd); }
+        return false;
+    }
+
+    char key[32], line_key[32], hex[2 * COOKIE_LEN + 1];
+    server_key(server, key, sizeof(key));
+    bool found = false;
+    while (!found && fscanf(f, "%31s %16s", line_key, hex) == 2) {
+        if (strcmp(key, line_key) != 0 || strlen(hex) != 2 * COOKIE_LEN) { continue; }
+        for (int i = 0; i < COOKIE_LEN; i++) {
+            unsigned int byte;
+            sscanf(hex + 2 * i, "%2x", &byte);
+            cookie[i] = byte;
+        }
+        found = true;
+    }
+    fclose(f);
+    return found;
+}
+
+void fastopen_store_cookie(struct sockaddr_in* server, const uint8_t* cookie) {
+    char key[32];
+    server_key(server, key, sizeof(key));
+    char path[512], tmp_path[528];
+    if (!fastopen_path(FASTOPEN_CACHE_FILE, path, sizeof(path))) { return; }
+
+    // Rewrite the cache without this server's old entry
+    char lines[64][64];
+    int n = 0;
+    int fd = open_private(path, O_RDONLY);
+    FILE* f = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (fd >= 0 && f == NULL) { close(fd); }
+    if (f != NULL) {
+        char line_key[32], hex[2 * COOKIE_LEN + 1];
+        while (n < 63 && fscanf(f, "%31s %16s", line_key, hex) == 2) {
+            if (strcmp(key, line_key) != 0) {
+                snprintf(lines[n++], sizeof(lines[0]), "%s %s", line_key, hex);
+            }
+        }
+        fclose(f);
+    }
+
+    // Into a new file that then replaces the old one, so a reader never sees
+    // half of it and nothing already at the path is written through
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int) getpid());
+    unlink(tmp_path);
+    fd = open_private(tmp_path, O_WRONLY | O_CREAT | O_EXCL);
+    f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (f == NULL) {
+        if (fd >= 0) { close(fd); }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        fprintf(f, "%s\n", lines[i]);
+    }
+    fprintf(f, "%s ", key);
+    for (int i = 0; i < COOKIE_LEN; i++) {
+        fprintf(f, "%02x", cookie[i]);
+    }
+    fprintf(f, "\n");
+    if (fclose(f) != 0 || rename(tmp_path, path) < 0) { unlink(tmp_path); }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define COOKIE_LEN 8 // Fast open cookie carried in SYN / SYN-ACK payloads
+
+// Both files live in a directory only this user can enter, under
+// $XDG_CACHE_HOME (or ~/.cache), and are created with mode 0600
+#define FASTOPEN_DIR "udp-echo"
+// Secret the server keys its cookies with; kept across runs so cookies from an
+// earlier connection stay valid
+#define FASTOPEN_SECRET_FILE "fastopen.key"
+// Cookies a client received, one "<ip>:<port> <cookie hex>" line per server
+#define FASTOPEN_CACHE_FILE "fastopen.cache"
+
+// Server: cookie for a client address (bound to its IP, not its port)
+void fastopen_cookie(struct sockaddr_in* client, uint8_t* cookie);
+
+// Server: check a cookie presented by a client
+bool fastopen_cookie_valid(struct sockaddr_in* client, const uint8_t* cookie);
+
+// Client: look up the cookie a server gave us earlier
+bool fastopen_load_cookie(struct sockaddr_in* server, uint8_t* cookie);
+
+// Client: remember a cookie for the next connection to this server
+void fastopen_store_cookie(struct sockaddr_in* server, const uint8_t* cookie);
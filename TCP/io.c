@@ -1,9 +1,13 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include "consts.h"
 
 void init_io() {
     int flags = fcntl(STDIN_FILENO, F_GETFL);
@@ -21,9 +25,95 @@ ssize_t input_io(uint8_t* buf, size_t max_length) {
         fprintf(stderr, "[ERROR] read() failed to read data from STDIN.\n");
         exit(1);
     }
+    if (len == 0 && max_length > 0){
+        return -1; // end of file
+    }
+    return len;
+}
+
+static uint8_t pending[65536]; // Input read but not handed out yet
+static size_t pending_len = 0;
+static bool eof = false;
+
+static void read_pending() {
+    if (!eof && pending_len < sizeof(pending)){
+        ssize_t len = input_io(pending + pending_len, sizeof(pending) - pending_len);
+        if (len < 0){ eof = true; }
+        else { pending_len += len; }
+    }
+}
+
+static ssize_t take_pending(uint8_t* buf, size_t len) {
+    memcpy(buf, pending, len);
+    pending_len -= len;
+    memmove(pending, pending + len, pending_len);
     return len;
 }
 
+ssize_t input_message(uint8_t* buf, size_t max_length) {
+    read_pending();
+
+    // A message ends at a newline, at max_length, or at the end of input
+    uint8_t* newline = memchr(pending, '\n', pending_len);
+    size_t len = newline != NULL ? (size_t) (newline - pending) + 1 : pending_len;
+    if (newline == NULL && !eof && pending_len < max_length && pending_len < sizeof(pending)){
+        return 0; // the line is not complete yet
+    }
+    if (len == 0){ return eof ? -1 : 0; }
+    if (len > max_length){ len = max_length; }
+    return take_pending(buf, len);
+}
+
 void output_io(uint8_t* buf, size_t length) {
     write(STDOUT_FILENO, buf, length); 
 }
+
+static int line_stream = -1; // Stream the rest of a cut line belongs to
+
+ssize_t input_stream_line(uint16_t stream, uint8_t* buf, size_t max_length) {
+    if (line_stream >= 0 && line_stream != stream){
+        return eof && pending_len == 0 ? -1 : 0;
+    }
+    read_pending();
+
+    // As many whole lines as fit
+    size_t len = 0;
+    uint8_t* newline;
+    while ((newline = memchr(pending + len, '\n', pending_len - len)) != NULL &&
+           (size_t) (newline - pending) + 1 <= max_length){
+        len = (newline - pending) + 1;
+    }
+    line_stream = -1;
+    if (len == 0 && pending_len >= max_length){
+        len = max_length; // a line too long for one packet: the rest follows on this stream
+        line_stream = stream;
+    }
+    else if (len == 0 && eof){
+        len = pending_len; // the last line, without a newline
+    }
+    if (len == 0){ return eof ? -1 : 0; }
+    return take_pending(buf, len);
+}
+
+static uint8_t* partial[MAX_STREAMS]; // Start of a stream's line that has not ended yet
+static size_t partial_len[MAX_STREAMS];
+
+void output_stream_line(uint16_t stream, uint8_t* buf, size_t length) {
+    uint8_t* newline = memrchr(buf, '\n', length);
+    size_t whole = newline != NULL ? (size_t) (newline - buf) + 1 : 0;
+    if (whole > 0){
+        output_io(partial[stream], partial_len[stream]);
+        output_io(buf, whole);
+        partial_len[stream] = 0;
+    }
+    partial[stream] = realloc(partial[stream], partial_len[stream] + length - whole);
+    memcpy(partial[stream] + partial_len[stream], buf + whole, length - whole);
+    partial_len[stream] += length - whole;
+}
+
+void flush_stream_lines() {
+    for (int i = 0; i < MAX_STREAMS; i++){
+        if (partial_len[i] > 0){ output_io(partial[i], partial_len[i]); }
+        partial_len[i] = 0;
+    }
+}
@@ -6,8 +6,24 @@
 // Initialize IO layer
 void init_io();
 
-// Get input from IO layer
+// Get input from IO layer; returns 0 if none is ready yet, -1 at end of input
 ssize_t input_io(uint8_t* buf, size_t max_length);
 
+// Get one message from IO layer: a line of input, cut into pieces of at most
+// max_length bytes; returns 0 if no whole line is ready yet, -1 at end of input
+ssize_t input_message(uint8_t* buf, size_t max_length);
+
 // Output to IO layer
 void output_io(uint8_t* buf, size_t length);
+
+// Input for several streams: every line goes whole to one stream, the next
+// stream that asks. Pieces of a line longer than max_length stay on the stream
+// the line started on, which gets them before any other stream gets data.
+ssize_t input_stream_line(uint16_t stream, uint8_t* buf, size_t max_length);
+
+// Output for several streams: a stream's data is written out a line at a time,
+// so lines of different streams never mix
+void output_stream_line(uint16_t stream, uint8_t* buf, size_t length);
+
+// Write out what is left of lines that never ended
+void flush_stream_lines();
@@ -2,18 +2,63 @@
 #include "transport.h"
 #include "io.h"
 #include <arpa/inet.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: server <port>\n");
+    // Parse options
+    int paths = 1;
+    int lifetime_ms = 0, max_retransmits = -1;
+    bool messages = false;
+    int n_streams = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:CzFm:M:R:n:U")) != -1) {
+        switch (opt) {
+        case 'f': // parity packet per k data packets, or "auto"
+            set_fec(strcmp(optarg, "auto") == 0 ? FEC_ADAPTIVE : atoi(optarg));
+            break;
+        case 'C': // no end-to-end checksums
+            set_checksum(false);
+            break;
+        case 'z': // compress streams if the peer agrees
+            set_compression(true);
+            break;
+        case 'F': // fast open: data in the SYN with a cookie from an earlier connection
+            set_fast_open(true);
+            break;
+        case 'm': // stripe over this many paths: ports <port> .. <port>+paths-1
+            paths = atoi(optarg);
+            break;
+        case 'n': // independently ordered streams; each line of input goes on one
+            n_streams = atoi(optarg);
+            break;
+        case 'U': // UDP only: no shared memory with a same-host peer
+            set_shared_memory(false);
+            break;
+        case 'M': // message mode: give up on a line not ACKed within this many ms
+            lifetime_ms = atoi(optarg);
+            messages = true;
+            break;
+        case 'R': // message mode: give up on a line after this many retransmissions
+            max_retransmits = atoi(optarg);
+            messages = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: server [-f <k|auto>] [-C] [-z] [-F] [-m paths] [-M ms] [-R n] [-n streams] [-U] <port>\n");
+            exit(1);
+        }
+    }
+
+    if (argc - optind < 1) {
+        fprintf(stderr, "Usage: server [-f <k|auto>] [-C] [-z] [-F] [-m paths] [-M ms] [-R n] [-n streams] [-U] <port>\n");
         exit(1);
     }
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
 
     // Create socket
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);  // use IPv4 and UDP
@@ -28,6 +73,16 @@ int main(int argc, char** argv) {
     // Bind address to socket
     bind(sockfd, (struct sockaddr*) &server_addr, sizeof(server_addr));
 
+    // Every other path listens on the next port; the client's address on it
+    // is learned from its join, which must carry the nonce of our SYN-ACK
+    for (int i = 1; i < paths; i++){
+        int path_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in path_addr = server_addr;
+        path_addr.sin_port = htons(port + i);
+        bind(path_fd, (struct sockaddr*) &path_addr, sizeof(path_addr));
+        add_subflow(path_fd, NULL);
+    }
+
     // Create struct to store client's address
     struct sockaddr_in client_addr = {0};       // zeros out every field in the struct
     socklen_t s = sizeof(client_addr);
@@ -38,7 +93,14 @@ int main(int argc, char** argv) {
     fprintf(stderr, "Server recv_bytes = %d \n", recv_bytes);
 
     init_io();
-    listen_loop(sockfd, &client_addr, SERVER_AWAIT, input_io, output_io);
+    if (messages){ set_message_mode(lifetime_ms, max_retransmits); }
+    if (n_streams > 1){
+        listen_loop_streams(sockfd, &client_addr, SERVER_AWAIT, n_streams, input_stream_line, output_stream_line);
+        flush_stream_lines();
+    }
+    else {
+        listen_loop(sockfd, &client_addr, SERVER_AWAIT, messages ? input_message : input_io, output_io);
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "shm.h"
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RING_MASK (SHM_RING_SIZE - 1)
+#define CHANNEL_FDS 5 // memfd, then the data and space eventfds of both rings
+
+typedef struct {
+    uint32_t length;
+    uint16_t stream;
+    uint16_t unused;
+} record_header;
+
+// Bytes a record takes in the ring: header and payload, 8-byte aligned
+static size_t record_size(size_t len){
+    return (sizeof(record_header) + len + 7) & ~(size_t) 7;
+}
+
+// Copy in or out of the ring at a byte position, wrapping at its end
+static void ring_write(shm_ring* r, uint64_t pos, const void* src, size_t len){
+    size_t off = pos & RING_MASK;
+    size_t first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+    memcpy(r->data + off, src, first);
+    memcpy(r->data, (const uint8_t*) src + first, len - first);
+}
+
+static void ring_read(shm_ring* r, uint64_t pos, void* dst, size_t len){
+    size_t off = pos & RING_MASK;
+    size_t first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+    memcpy(dst, r->data + off, first);
+    memcpy((uint8_t*) dst + first, r->data, len - first);
+}
+
+// Wake the other side if it said it is going to sleep. The fence orders our
+// head/tail update before the check, against its flag store before its recheck.
+static void wake(_Atomic bool* waiting, int fd){
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed)){
+        atomic_store_explicit(waiting, false, memory_order_relaxed);
+        eventfd_write(fd, 1);
+    }
+}
+
+static void socket_name(uint16_t port, struct sockaddr_un* addr, socklen_t* len){
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    // Abstract namespace (leading NUL): no file to clean up, gone with the socket
+    int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, SHM_SOCKET_NAME, port);
+    *len = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+// Map the rings and sort out which are ours: ring 0 carries client-to-server data
+static bool map_channel(const int* fds, bool server, shm_channel* ch){
+    shm_ring* rings = mmap(NULL, 2 * sizeof(shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (rings == MAP_FAILED){
+        perror("[ERROR] mmap() failed for the shared-memory rings");
+        return false;
+    }
+    memset(ch, 0, sizeof(*ch));
+    int tx = server ? 1 : 0;
+    ch->tx = &rings[tx];
+    ch->rx = &rings[1 - tx];
+    ch->tx_data_fd = fds[1 + 2 * tx];
+    ch->tx_space_fd = fds[2 + 2 * tx];
+    ch->rx_data_fd = fds[1 + 2 * (1 - tx)];
+    ch->rx_space_fd = fds[2 + 2 * (1 - tx)];
+    return true;
+}
+
+int shm_listen(uint16_t port){
+    int sockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0){ return -1; }
+    // Have the kernel attach the sender's credentials, to check them on arrival
+    setsockopt(sockfd, SOL_SOCKET, SO_PASSCRED, &(int) {1}, sizeof(int));
+
+    struct sockaddr_un addr;
+    socklen_t len;
+    socket_name(port, &addr, &len);
+    if (bind(sockfd, (struct sockaddr*) &addr, len) < 0){
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+bool shm_offer(uint16_t port, shm_channel* ch){
+    int fds[CHANNEL_FDS];
+    fds[0] = memfd_create("udp-echo-shm", MFD_CLOEXEC);
+    if (fds[0] < 0 || ftruncate(fds[0], 2 * sizeof(shm_ring)) < 0){
+        if (fds[0] >= 0){ close(fds[0]); }
+        return false;
+    }
+    for (int i = 1; i < CHANNEL_FDS; i++){
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    if (!map_channel(fds, true, ch)){
+        for (int i = 0; i < CHANNEL_FDS; i++){ close(fds[i]); }
+        return false;
+    }
+
+    // Hand the memfd and eventfds over in one datagram (SCM_RIGHTS)
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    socket_name(port, &addr, &addr_len);
+    uint8_t byte = 0;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {&addr, addr_len, &iov, 1, control.buf, sizeof(control.buf), 0};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int sockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    bool sent = sockfd >= 0 && sendmsg(sockfd, &msg, MSG_DONTWAIT) == 1;
+    if (sockfd >= 0){ close(sockfd); }
+    close(fds[0]); // the mapping stays
+    if (!sent){ shm_close(ch); }
+    return sent;
+}
+
+void shm_close(shm_channel* ch){
+    munmap(ch->tx < ch->rx ? ch->tx : ch->rx, 2 * sizeof(shm_ring));
+    close(ch->tx_data_fd);
+    close(ch->tx_space_fd);
+    close(ch->rx_data_fd);
+    close(ch->rx_space_fd);
+    memset(ch, 0, sizeof(*ch));
+}
+
+bool shm_readable(shm_channel* ch){
+    return atomic_load_explicit(&ch->rx->head, memory_order_acquire) !=
+           atomic_load_explicit(&ch->rx->tail, memory_order_relaxed);
+}
+
+bool shm_accept(int sockfd, shm_channel* ch){
+    uint8_t byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(CHANNEL_FDS * sizeof(int)) + CMSG_SPACE(sizeof(struct ucred))];
+    } control;
+    struct msghdr msg = {NULL, 0, &iov, 1, control.buf, sizeof(control.buf), 0};
+    if (recvmsg(sockfd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) < 0){ return false; }
+
+    int fds[CHANNEL_FDS];
+    int n_fds = 0;
+    bool same_user = false;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if (cmsg->cmsg_level != SOL_SOCKET){ continue; }
+        if (cmsg->cmsg_type == SCM_RIGHTS){
+            n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), (n_fds < CHANNEL_FDS ? n_fds : CHANNEL_FDS) * sizeof(int));
+        }
+        else if (cmsg->cmsg_type == SCM_CREDENTIALS){
+            struct ucred cred;
+            memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+            same_user = cred.uid == getuid();
+        }
+    }
+    if (n_fds != CHANNEL_FDS || !same_user){
+        fprintf(stderr, "[ERROR] Unexpected shared-memory offer (%d descriptors%s).\n",
+                n_fds, same_user ? "" : ", another user");
+        for (int i = 0; i < n_fds && i < CHANNEL_FDS; i++){ close(fds[i]); }
+        return false;
+    }
+    close(sockfd);
+    bool mapped = map_channel(fds, false, ch);
+    close(fds[0]); // the mapping stays
+    return mapped;
+}
+
+size_t shm_space(shm_channel* ch){
+    uint64_t head = atomic_load_explicit(&ch->tx->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ch->tx->tail, memory_order_acquire);
+    size_t free = SHM_RING_SIZE - (head - tail);
+    size_t overhead = sizeof(record_header) + 7; // header and alignment
+    return free > overhead ? free - overhead : 0;
+}
+
+bool shm_send(shm_channel* ch, uint16_t stream, const uint8_t* buf, size_t len){
+    shm_ring* r = ch->tx;
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t size = record_size(len);
+    if (SHM_RING_SIZE - (head - tail) < size){ return false; }
+
+    record_header hdr = {len, stream, 0};
+    ring_write(r, head, &hdr, sizeof(hdr));
+    ring_write(r, head + sizeof(hdr), buf, len);
+    atomic_store_explicit(&r->head, head + size, memory_order_release);
+    ch->bytes_sent += len;
+    wake(&r->consumer_waiting, ch->tx_data_fd);
+    return true;
+}
+
+ssize_t shm_recv(shm_channel* ch, uint16_t* stream, uint8_t* buf, size_t max_length){
+    shm_ring* r = ch->rx;
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (head == tail){ return -1; }
+
+    record_header hdr;
+    ring_read(r, tail, &hdr, sizeof(hdr));
+    if (hdr.length > max_length){ // the peer writes at most what we read in one go
+        fprintf(stderr, "[ERROR] Oversized shared-memory record on stream %u (%u bytes).\n",
+                hdr.stream, (unsigned) hdr.length);
+        exit(1);
+    }
+    size_t len = hdr.length;
+    ring_read(r, tail + sizeof(hdr), buf, len);
+    *stream = hdr.stream;
+    atomic_store_explicit(&r->tail, tail + record_size(hdr.length), memory_order_release);
+    ch->bytes_received += len;
+    wake(&r->producer_waiting, ch->rx_space_fd);
+    return len;
+}
+
+void shm_wait(shm_channel* ch, size_t space_needed, uint64_t timeout_us){
+    // Announce the sleep, then look again: a record written before the
+    // announcement is seen here, one written after it comes with a wakeup
+    atomic_store_explicit(&ch->rx->consumer_waiting, true, memory_order_relaxed);
+    if (space_needed > 0){ atomic_store_explicit(&ch->tx->producer_waiting, true, memory_order_relaxed); }
+    atomic_thread_fence(memory_order_seq_cst);
+
+    bool ready = atomic_load_explicit(&ch->rx->head, memory_order_relaxed) !=
+                 atomic_load_explicit(&ch->rx->tail, memory_order_relaxed);
+    if (space_needed > 0 && shm_space(ch) >= space_needed){ ready = true; }
+    if (!ready){
+        struct pollfd pfds[2] = {{ch->rx_data_fd, POLLIN, 0}, {ch->tx_space_fd, POLLIN, 0}};
+        poll(pfds, space_needed > 0 ? 2 : 1, (timeout_us + 999) / 1000);
+    }
+
+    atomic_store_explicit(&ch->rx->consumer_waiting, false, memory_order_relaxed);
+    atomic_store_explicit(&ch->tx->producer_waiting, false, memory_order_relaxed);
+    eventfd_t value;
+    eventfd_read(ch->rx_data_fd, &value);
+    eventfd_read(ch->tx_space_fd, &value);
+}
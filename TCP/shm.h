@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// Shared-memory channel between two processes on the same host: one ring per
+// direction in a memfd mapping, each with a single producer and a single
+// consumer. Records are appended and consumed with atomics only; an eventfd
+// wakes the other side, and only when it announced that it is going to sleep.
+#define SHM_RING_SIZE (1 << 22) // Bytes of records per direction
+#define SHM_FIN 0xFFFF          // Stream of the record that ends a direction
+#define SHM_TAKEN 0xFFFE        // Stream of the empty record a client writes first: it took the channel
+// Abstract unix socket the client receives the channel on, by its UDP port
+#define SHM_SOCKET_NAME "udp-echo-shm/%u"
+
+typedef struct {
+    _Atomic uint64_t head;            // Bytes written; only the producer moves it
+    uint8_t pad0[56];
+    _Atomic uint64_t tail;            // Bytes consumed; only the consumer moves it
+    uint8_t pad1[56];
+    _Atomic bool consumer_waiting;    // Consumer sleeps until head moves
+    _Atomic bool producer_waiting;    // Producer sleeps until tail moves
+    uint8_t pad2[62];
+    uint8_t data[SHM_RING_SIZE];
+} shm_ring;
+
+typedef struct {
+    shm_ring* tx;
+    shm_ring* rx;
+    int tx_data_fd;   // eventfd: wake the peer, there are records in tx
+    int tx_space_fd;  // eventfd: the peer freed space in tx
+    int rx_data_fd;   // eventfd: the peer wrote records to rx
+    int rx_space_fd;  // eventfd: wake the peer, there is space in rx
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+} shm_channel;
+
+// Client: socket to receive the server's channel on, named by our UDP port;
+// -1 if it cannot be set up (the offer is then not made)
+int shm_listen(uint16_t port);
+
+// Server: create a channel and send it to the client listening on port.
+// False if the client cannot be reached that way.
+bool shm_offer(uint16_t port, shm_channel* ch);
+
+// Client: take the channel the server sent, if it has arrived. Closes sockfd
+// once it has.
+bool shm_accept(int sockfd, shm_channel* ch);
+
+// Unmap a channel and close its eventfds (a server's offer the client did not take)
+void shm_close(shm_channel* ch);
+
+// Whether the peer wrote a record we have not taken yet
+bool shm_readable(shm_channel* ch);
+
+// Append a record; false if the ring has no room for it
+bool shm_send(shm_channel* ch, uint16_t stream, const uint8_t* buf, size_t len);
+
+// Take the next record; -1 if there is none. A record longer than max_length
+// means a broken peer: it is reported and the process exits.
+ssize_t shm_recv(shm_channel* ch, uint16_t* stream, uint8_t* buf, size_t max_length);
+
+// Largest record that fits in the ring we write to right now
+size_t shm_space(shm_channel* ch);
+
+// Sleep until the peer writes a record, frees space_needed bytes (0: do not
+// wait for space) or timeout_us passes
+void shm_wait(shm_channel* ch, size_t space_needed, uint64_t timeout_us);
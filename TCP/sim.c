@@ -0,0 +1,506 @@
+#include "consts.h"
+#include "transport.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Deterministic simulation: a client and a server run in one process, each in
+// its own thread, on a virtual clock and an in-memory link with seeded loss,
+// delay, jitter and an optional rate limit. Only one thread runs at a time: an
+// end runs until it would block, then the simulator moves the clock to the
+// next timer or packet arrival. The same options and seed give the same run.
+// With -m, the ends are connected by several paths, each with its own loss,
+// delay and rate; the transport sees one fake socket per path.
+// With -S, every stream sends messages instead: each carries its index and
+// send time, so the receiver checks their order and measures their latency.
+
+#define SIM_CLIENT 0
+#define SIM_SERVER 1
+#define SIM_NONE -1 // Turn of the simulator itself
+#define SIM_FD(path) (-1 - (path)) // Fake socket of a path: negative, so socket options fail harmlessly
+#define SIM_PATH(fd) (-1 - (fd))
+
+typedef struct datagram {
+    struct datagram* next;
+    uint64_t arrival_ns;
+    uint64_t id;        // Send order: breaks ties between equal arrival times
+    size_t len;
+    uint8_t data[0];
+} datagram;
+
+typedef struct {
+    pthread_t thread;
+    int initial_state;
+    struct sockaddr_in addr[MAX_SUBFLOWS]; // Fake address the peer sees on each path
+    struct sockaddr_in peer;   // Filled in by the transport from received packets
+    bool blocked;              // Waiting in sim_wait()
+    uint64_t deadline_ns;      // Wakeup time while blocked
+    bool done;                 // listen_loop returned
+    datagram* inbox[MAX_SUBFLOWS];         // Datagrams on the way to this end per path, by arrival time
+    uint64_t link_free_ns[MAX_SUBFLOWS];   // When each path towards the peer is done sending
+    uint64_t sent[MAX_STREAMS];     // Bytes handed to the transport per stream
+    uint64_t received[MAX_STREAMS]; // Bytes delivered per stream
+    uint64_t complete_ns;      // Virtual time all of the peer's data had arrived
+    bool corrupt;              // Delivered data differed from what the peer sent
+    uint64_t packets_sent[MAX_SUBFLOWS];
+    uint64_t packets_lost[MAX_SUBFLOWS];
+    uint64_t next_msg[MAX_STREAMS]; // Lowest message index still to come per stream
+    uint64_t msgs_received;
+    uint64_t* latency_ns;      // Latency of each message delivered
+    uint64_t last_ns;          // Virtual time the last message arrived
+} endpoint;
+
+endpoint ends[2];
+uint64_t now = 1000000000ULL; // Virtual clock; starts at 1 s so no deadline is 0
+uint64_t next_id = 0;
+uint64_t rng_state;
+
+// Scenario; loss, delay and rate are per path
+uint64_t bytes = 100000;    // Per stream and direction
+int n_streams = 1;
+int n_paths = 1;
+double loss[MAX_SUBFLOWS];  // Drop probability per datagram
+double delay_ns[MAX_SUBFLOWS];
+uint64_t jitter_ns = 0;
+double rate_bps[MAX_SUBFLOWS]; // 0: no rate limit
+int queue_limit = 0;        // Full-size packets queued at the rate limit before drops (0: no limit)
+int fec = FEC_OFF;
+bool compress = false;
+uint64_t time_limit_ns = 3600 * 1000000000ULL;
+size_t msg_size = 0;        // Message size (0: byte streams)
+int msg_lifetime_ms = 0;    // Message mode: deadline (0: none)
+int msg_retransmits = -1;   // Message mode: retransmission limit (-1: none)
+bool messages = false;      // Message mode in the transport
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t turn_changed = PTHREAD_COND_INITIALIZER;
+int turn = SIM_NONE;
+_Thread_local int me; // Endpoint of the calling thread
+
+// xorshift64*: the only source of randomness
+double sim_random(){
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 2685821657736338717ULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Byte at offset off of a stream sent by an end: cheap to make and to check
+static uint8_t pattern(int from, uint16_t stream, uint64_t off){
+    return (uint8_t) ((off * 2654435761ULL) >> 13) ^ (from * 31 + stream * 7);
+}
+
+// Hand the turn to `next` and sleep until it comes back to `who`
+static void switch_to(int next, int who){
+    pthread_mutex_lock(&lock);
+    turn = next;
+    pthread_cond_broadcast(&turn_changed);
+    while (turn != who){ pthread_cond_wait(&turn_changed, &lock); }
+    pthread_mutex_unlock(&lock);
+}
+
+// Network seen by the transport
+uint64_t sim_now_ns(){
+    return now;
+}
+
+ssize_t sim_send(int sockfd, const void* buf, size_t len, const struct sockaddr_in* addr){
+    (void) addr;
+    int path = SIM_PATH(sockfd);
+    endpoint* from = &ends[me];
+    endpoint* to = &ends[1 - me];
+    from->packets_sent[path]++;
+
+    // Serialize behind earlier packets when the path has a rate; drop when its queue is full
+    uint64_t departure = now;
+    if (rate_bps[path] > 0){
+        uint64_t tx_ns = (uint64_t) (len * 8 * 1e9 / rate_bps[path]);
+        uint64_t queue_ns = (uint64_t) (queue_limit * MAX_PACKET * 8 * 1e9 / rate_bps[path]);
+        uint64_t start = MAX(now, from->link_free_ns[path]);
+        if (queue_limit > 0 && start - now >= queue_ns){
+            from->packets_lost[path]++;
+            return len;
+        }
+        from->link_free_ns[path] = start + tx_ns;
+        departure = from->link_free_ns[path];
+    }
+    if (sim_random() < loss[path]){
+        from->packets_lost[path]++;
+        return len;
+    }
+
+    datagram* dgram = malloc(sizeof(datagram) + len);
+    dgram->arrival_ns = departure + (uint64_t) delay_ns[path] + (uint64_t) (sim_random() * jitter_ns);
+    dgram->id = next_id++;
+    dgram->len = len;
+    memcpy(dgram->data, buf, len);
+
+    datagram** link = &to->inbox[path];
+    while (*link != NULL && (*link)->arrival_ns <= dgram->arrival_ns){
+        link = &(*link)->next;
+    }
+    dgram->next = *link;
+    *link = dgram;
+    return len;
+}
+
+ssize_t sim_recv(int sockfd, void* buf, size_t len, struct sockaddr_in* addr){
+    int path = SIM_PATH(sockfd);
+    endpoint* end = &ends[me];
+    datagram* dgram = end->inbox[path];
+    if (dgram == NULL || dgram->arrival_ns > now){
+        errno = EAGAIN;
+        return -1;
+    }
+    end->inbox[path] = dgram->next;
+    size_t n = MIN(len, dgram->len);
+    memcpy(buf, dgram->data, n);
+    *addr = ends[1 - me].addr[path];
+    free(dgram);
+    return n;
+}
+
+void sim_wait(const int* sockfds, int n, uint64_t deadline_ns){
+    (void) sockfds;
+    (void) n;
+    endpoint* end = &ends[me];
+    end->blocked = true;
+    end->deadline_ns = deadline_ns;
+    switch_to(SIM_NONE, me);
+    end->blocked = false;
+}
+
+const transport_io sim_io = {sim_now_ns, sim_send, sim_recv, sim_wait};
+
+// Messages per stream with -S
+static uint64_t msgs_per_stream(){
+    return MAX(bytes / msg_size, 1);
+}
+
+// A message: its index in the stream and send time, then the stream's pattern
+static ssize_t sim_input_message(uint16_t stream, uint8_t* buf){
+    endpoint* end = &ends[me];
+    uint64_t index = end->sent[stream] / msg_size;
+    if (index >= msgs_per_stream()){ return -1; }
+    memcpy(buf, &index, sizeof(index));
+    memcpy(buf + sizeof(index), &now, sizeof(now));
+    for (size_t i = 2 * sizeof(uint64_t); i < msg_size; i++){
+        buf[i] = pattern(me, stream, index * msg_size + i);
+    }
+    end->sent[stream] += msg_size;
+    return msg_size;
+}
+
+// Messages may be missing, but the ones delivered must be whole and in order
+static void sim_output_message(uint16_t stream, uint8_t* buf, size_t length){
+    endpoint* end = &ends[me];
+    if (length != msg_size){
+        end->corrupt = true;
+        return;
+    }
+    uint64_t index, sent_ns;
+    memcpy(&index, buf, sizeof(index));
+    memcpy(&sent_ns, buf + sizeof(index), sizeof(sent_ns));
+    if (index < end->next_msg[stream] || index >= msgs_per_stream()){
+        end->corrupt = true;
+        return;
+    }
+    for (size_t i = 2 * sizeof(uint64_t); i < length; i++){
+        if (buf[i] != pattern(1 - me, stream, index * msg_size + i)){ end->corrupt = true; }
+    }
+    end->next_msg[stream] = index + 1;
+    end->received[stream] += length;
+    end->latency_ns[end->msgs_received++] = now - sent_ns;
+    end->last_ns = now;
+    if (end->msgs_received == msgs_per_stream() * n_streams){ end->complete_ns = now; }
+}
+
+// Application data: every stream sends `bytes` bytes of its pattern
+ssize_t sim_input(uint16_t stream, uint8_t* buf, size_t max_length){
+    if (msg_size > 0){ return sim_input_message(stream, buf); }
+    endpoint* end = &ends[me];
+    uint64_t left = bytes - end->sent[stream];
+    if (left == 0){ return -1; }
+    size_t n = MIN(max_length, left);
+    for (size_t i = 0; i < n; i++){
+        buf[i] = pattern(me, stream, end->sent[stream] + i);
+    }
+    end->sent[stream] += n;
+    return n;
+}
+
+void sim_output(uint16_t stream, uint8_t* buf, size_t length){
+    if (msg_size > 0){
+        sim_output_message(stream, buf, length);
+        return;
+    }
+    endpoint* end = &ends[me];
+    for (size_t i = 0; i < length; i++){
+        if (buf[i] != pattern(1 - me, stream, end->received[stream] + i)){ end->corrupt = true; }
+    }
+    end->received[stream] += length;
+
+    for (int i = 0; i < n_streams; i++){
+        if (end->received[i] < bytes){ return; }
+    }
+    end->complete_ns = now;
+}
+
+void* run_end(void* arg){
+    me = (int) (intptr_t) arg;
+    pthread_mutex_lock(&lock);
+    while (turn != me){ pthread_cond_wait(&turn_changed, &lock); }
+    pthread_mutex_unlock(&lock);
+
+    set_io(&sim_io);
+    set_fec(fec);
+    set_compression(compress);
+    if (messages){ set_message_mode(msg_lifetime_ms, msg_retransmits); }
+    endpoint* end = &ends[me];
+    for (int i = 1; i < n_paths; i++){
+        add_subflow(SIM_FD(i), me == SIM_CLIENT ? &ends[SIM_SERVER].addr[i] : NULL);
+    }
+    listen_loop_streams(SIM_FD(0), &end->peer, end->initial_state, n_streams, sim_input, sim_output);
+
+    end->done = true;
+    pthread_mutex_lock(&lock);
+    turn = SIM_NONE;
+    pthread_cond_broadcast(&turn_changed);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Whether an end has something to do at the current time
+static bool runnable(endpoint* end){
+    if (end->done){ return false; }
+    if (!end->blocked || end->deadline_ns <= now){ return true; }
+    for (int i = 0; i < n_paths; i++){
+        if (end->inbox[i] != NULL && end->inbox[i]->arrival_ns <= now){ return true; }
+    }
+    return false;
+}
+
+// Earliest time at which an end has something to do
+static uint64_t next_event(){
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < 2; i++){
+        if (ends[i].done){ continue; }
+        next = MIN(next, ends[i].deadline_ns);
+        for (int j = 0; j < n_paths; j++){
+            if (ends[i].inbox[j] != NULL){ next = MIN(next, ends[i].inbox[j]->arrival_ns); }
+        }
+    }
+    return next;
+}
+
+static double wall_seconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill one value per path from a comma-separated list; the last value repeats
+static void parse_paths(const char* arg, double* values, double scale){
+    double value = 0;
+    for (int i = 0; i < MAX_SUBFLOWS; i++){
+        if (*arg != '\0'){
+            char* end;
+            value = strtod(arg, &end) * scale;
+            arg = *end == ',' ? end + 1 : end;
+        }
+        values[i] = value;
+    }
+}
+
+static int compare_u64(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Messages delivered and their latency; without a deadline or retransmission
+// limit every message must arrive
+static bool report_messages(int from){
+    endpoint* receiver = &ends[1 - from];
+    uint64_t total = msgs_per_stream() * n_streams;
+    uint64_t n = receiver->msgs_received;
+
+    printf("%s -> %s: ", from == SIM_CLIENT ? "client" : "server", from == SIM_CLIENT ? "server" : "client");
+    if (receiver->corrupt){
+        printf("messages corrupted or out of order\n");
+        return false;
+    }
+    printf("%lu of %lu messages delivered", n, total);
+    if (n > 0){
+        qsort(receiver->latency_ns, n, sizeof(uint64_t), compare_u64);
+        printf(" by %.3f s; latency p50 %.1f ms, p99 %.1f ms, max %.1f ms",
+               (receiver->last_ns - 1000000000ULL) / 1e9, receiver->latency_ns[n / 2] / 1e6,
+               receiver->latency_ns[n * 99 / 100] / 1e6, receiver->latency_ns[n - 1] / 1e6);
+    }
+    printf("\n");
+    return n == total || messages;
+}
+
+static bool report(int from){
+    if (msg_size > 0){ return report_messages(from); }
+    endpoint* sender = &ends[from];
+    endpoint* receiver = &ends[1 - from];
+    uint64_t total = 0;
+    for (int i = 0; i < n_streams; i++){ total += receiver->received[i]; }
+
+    printf("%s -> %s: ", from == SIM_CLIENT ? "client" : "server", from == SIM_CLIENT ? "server" : "client");
+    if (receiver->corrupt){
+        printf("data corrupted\n");
+        return false;
+    }
+    if (receiver->complete_ns == 0){
+        printf("%lu of %lu bytes delivered\n", total, bytes * n_streams);
+        return false;
+    }
+    uint64_t packets_sent = 0, packets_lost = 0;
+    for (int i = 0; i < n_paths; i++){
+        packets_sent += sender->packets_sent[i];
+        packets_lost += sender->packets_lost[i];
+    }
+    double seconds = (receiver->complete_ns - 1000000000ULL) / 1e9;
+    double kbits = seconds > 0 ? total * 8 / seconds / 1000 : 0;
+    printf("%lu bytes in %.3f s (%.1f kbit/s goodput); %lu packets sent, %lu lost\n",
+           total, seconds, kbits, packets_sent, packets_lost);
+    for (int i = 0; n_paths > 1 && i < n_paths; i++){
+        printf("    path %d: %lu packets sent, %lu lost\n", i, sender->packets_sent[i], sender->packets_lost[i]);
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    // Parse options
+    uint64_t seed = 1;
+    bool verbose = false;
+    parse_paths("10", delay_ns, 1000000);
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:m:l:d:j:r:q:s:f:zt:vS:M:R:")) != -1) {
+        switch (opt) {
+        case 'b': // bytes per stream and direction
+            bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'n': // streams
+            n_streams = MAX(1, MIN(atoi(optarg), MAX_STREAMS));
+            break;
+        case 'm': // paths between the ends
+            n_paths = MAX(1, MIN(atoi(optarg), MAX_SUBFLOWS));
+            break;
+        case 'l': // loss probability per datagram, each way (per path: a,b,...)
+            parse_paths(optarg, loss, 1);
+            break;
+        case 'd': // one-way delay in ms (per path: a,b,...)
+            parse_paths(optarg, delay_ns, 1000000);
+            break;
+        case 'j': // extra random delay of up to this many ms (reorders packets)
+            jitter_ns = atof(optarg) * 1000000;
+            break;
+        case 'r': // link rate in Mbit/s, each way (per path: a,b,...)
+            parse_paths(optarg, rate_bps, 1000000);
+            break;
+        case 'q': // packets queued at the link rate before drops
+            queue_limit = atoi(optarg);
+            break;
+        case 's': // random seed
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'f': // parity packet per k data packets, or "auto"
+            fec = strcmp(optarg, "auto") == 0 ? FEC_ADAPTIVE : atoi(optarg);
+            break;
+        case 'z': // compress streams
+            compress = true;
+            break;
+        case 't': // give up after this much virtual time, in seconds
+            time_limit_ns = atof(optarg) * 1000000000ULL;
+            break;
+        case 'v': // keep the transport's debug output (stderr)
+            verbose = true;
+            break;
+        case 'S': // send messages of this many bytes instead of byte streams
+            msg_size = MAX(2 * sizeof(uint64_t), MIN(strtoull(optarg, NULL, 10), MAX_PAYLOAD));
+            break;
+        case 'M': // message mode: give up on a message not ACKed within this many ms
+            msg_lifetime_ms = atoi(optarg);
+            messages = true;
+            break;
+        case 'R': // message mode: give up on a message after this many retransmissions
+            msg_retransmits = atoi(optarg);
+            messages = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: sim [-b bytes] [-n streams] [-m paths] [-l loss] [-d delay_ms] [-j jitter_ms] "
+                    "[-r mbit/s] [-q packets] [-s seed] [-f <k|auto>] [-z] [-t seconds] [-v]\n"
+                    "           [-S msg_bytes [-M ms] [-R n]]\n"
+                    "       -l, -d and -r take one value per path (a,b,...); the last one repeats\n");
+            exit(1);
+        }
+    }
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    if (messages && msg_size == 0){ msg_size = MAX_PAYLOAD; }
+    for (int i = 0; msg_size > 0 && i < 2; i++){
+        ends[i].latency_ns = calloc(msgs_per_stream() * n_streams, sizeof(uint64_t));
+    }
+    for (int i = 0; bytes == 0 && i < 2; i++){
+        ends[i].complete_ns = now; // nothing to deliver: complete from the start
+    }
+    if (!verbose && freopen("/dev/null", "w", stderr) == NULL){
+        perror("[ERROR] freopen() failed");
+        exit(1);
+    }
+
+    ends[SIM_CLIENT].initial_state = CLIENT_START;
+    ends[SIM_SERVER].initial_state = SERVER_AWAIT;
+    for (int i = 0; i < 2; i++){
+        for (int j = 0; j < n_paths; j++){
+            ends[i].addr[j].sin_family = AF_INET;
+            ends[i].addr[j].sin_addr.s_addr = htonl(0x7f000001);
+            ends[i].addr[j].sin_port = htons(9000 + 100 * i + j);
+        }
+    }
+    for (int i = 0; i < 2; i++){
+        ends[i].peer = ends[1 - i].addr[0];
+    }
+
+    // Both threads start by waiting for their turn; the server runs first
+    double wall_start = wall_seconds();
+    for (int i = 0; i < 2; i++){
+        pthread_create(&ends[i].thread, NULL, run_end, (void*) (intptr_t) i);
+    }
+    bool finished = true;
+    while (!ends[SIM_CLIENT].done || !ends[SIM_SERVER].done){
+        if (runnable(&ends[SIM_SERVER])){
+            switch_to(SIM_SERVER, SIM_NONE);
+        }
+        else if (runnable(&ends[SIM_CLIENT])){
+            switch_to(SIM_CLIENT, SIM_NONE);
+        }
+        else{
+            uint64_t next = next_event();
+            if (next == UINT64_MAX || next - 1000000000ULL > time_limit_ns){
+                finished = false;
+                break;
+            }
+            now = next;
+        }
+    }
+    double wall = wall_seconds() - wall_start;
+
+    bool ok = report(SIM_CLIENT);
+    ok = report(SIM_SERVER) && ok;
+    if (!finished){
+        printf("[ERROR] Connection still open after %.3f s of virtual time.\n", (now - 1000000000ULL) / 1e9);
+        exit(1); // the transport threads are still blocked
+    }
+    printf("[INFO] Both ends closed after %.3f s of virtual time (%.3f s wall clock).\n",
+           (now - 1000000000ULL) / 1e9, wall);
+    for (int i = 0; i < 2; i++){
+        pthread_join(ends[i].thread, NULL);
+    }
+    return ok ? 0 : 1;
+}
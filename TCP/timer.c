@@ -0,0 +1,133 @@
+#include "timer.h"
+#include <string.h>
+#include <time.h>
+
+static uint64_t monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t (*clock_fn)(void) = monotonic_ns;
+
+uint64_t clock_ns(){
+    return clock_fn();
+}
+
+void set_clock(uint64_t (*fn)(void)){
+    clock_fn = fn != NULL ? fn : monotonic_ns;
+}
+
+// Tick the clock is currently in
+static uint64_t current_tick(timer_wheel* wheel){
+    return (clock_ns() - wheel->start_ns) / wheel->tick_ns;
+}
+
+void wheel_init(timer_wheel* wheel, uint64_t tick_us){
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->start_ns = clock_ns();
+    wheel->tick_ns = tick_us * 1000;
+}
+
+void timer_init(timer* t, void (*fn)(void*), void* arg){
+    memset(t, 0, sizeof(*t));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+// Link a timer into the slot for its expiry: the lowest level whose range covers it
+static void wheel_insert(timer_wheel* wheel, timer* t){
+    uint64_t delta = t->expires - wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))){
+        level++;
+    }
+    if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS))){  // beyond the wheel: fire at its edge
+        t->expires = wheel->now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+
+    timer** slot = &wheel->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next = *slot;
+    if (*slot != NULL){ (*slot)->pprev = &t->next; }
+    *slot = t;
+    t->pprev = slot;
+}
+
+void timer_cancel(timer* t){
+    if (!timer_pending(t)){ return; }
+    *t->pprev = t->next;
+    if (t->next != NULL){ t->next->pprev = t->pprev; }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void timer_set(timer_wheel* wheel, timer* t, uint64_t delay_us){
+    timer_cancel(t);
+    uint64_t ticks = (delay_us * 1000 + wheel->tick_ns - 1) / wheel->tick_ns;
+    uint64_t now = current_tick(wheel);
+    if (now < wheel->now){ now = wheel->now; }  // never behind the tick being processed
+    t->expires = now + (ticks > 0 ? ticks : 1);
+    wheel_insert(wheel, t);
+}
+
+// Move the timers of one higher-level slot down to the levels below
+static void cascade(timer_wheel* wheel, int level){
+    timer** slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer* t = *slot;
+    *slot = NULL;
+    while (t != NULL){
+        timer* next = t->next;
+        t->pprev = NULL;
+        wheel_insert(wheel, t);
+        t = next;
+    }
+}
+
+// Earliest tick at which a slot holds timers (or must be cascaded); UINT64_MAX if the wheel is empty
+static uint64_t next_event(timer_wheel* wheel){
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++){
+        int shift = WHEEL_BITS * level;
+        // Level 0 slots are processed every tick, higher ones when the level below wraps
+        uint64_t first = ((wheel->now + (1ULL << shift) - 1) >> shift) << shift;  // first such tick >= now
+        for (uint64_t i = 0; i < WHEEL_SIZE; i++){
+            uint64_t tick = first + (i << shift);
+            if (tick >= best){ break; }
+            if (wheel->slots[level][(tick >> shift) & WHEEL_MASK] != NULL){
+                best = tick;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+int wheel_run(timer_wheel* wheel){
+    int fired = 0;
+    uint64_t target = current_tick(wheel);
+    while (wheel->now <= target){
+        // Entering a new level-l slot: bring its timers down
+        for (int level = 1; level < WHEEL_LEVELS; level++){
+            if (wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1)){ break; }
+            cascade(wheel, level);
+        }
+
+        // Fire this tick's timers one by one, so callbacks may set or cancel any timer
+        timer** slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while (*slot != NULL){
+            timer* t = *slot;
+            timer_cancel(t);
+            if (t->fn != NULL){ t->fn(t->arg); }
+            fired++;
+        }
+        wheel->now++;
+    }
+
+    return fired;
+}
+
+uint64_t wheel_next_ns(timer_wheel* wheel){
+    uint64_t next = next_event(wheel);
+    if (next == UINT64_MAX){ return UINT64_MAX; }
+    return wheel->start_ns + next * wheel->tick_ns;
+}
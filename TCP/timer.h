@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel: WHEEL_LEVELS wheels of WHEEL_SIZE slots, each slot
+// spanning WHEEL_SIZE times the slots of the level below. Setting, resetting
+// and cancelling a timer are O(1); a timer moves down one level at a time as
+// its expiry gets near. The owner sleeps until wheel_next_ns() and then calls
+// wheel_run().
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4 // 64^4 ticks: about 4.6 hours at 1 ms per tick
+
+typedef struct timer {
+    struct timer* next;
+    struct timer** pprev;  // Link pointing at us; NULL when not pending
+    uint64_t expires;      // Tick at which the timer fires
+    void (*fn)(void*);     // Called on expiry (may be NULL: only wakes the owner)
+    void* arg;
+} timer;
+
+typedef struct {
+    uint64_t now;          // Next tick to process
+    uint64_t start_ns;     // clock_ns() time of tick 0
+    uint64_t tick_ns;
+    timer* slots[WHEEL_LEVELS][WHEEL_SIZE];
+} timer_wheel;
+
+// Time in ns on the clock the wheels run on: CLOCK_MONOTONIC unless set_clock()
+// picked another
+uint64_t clock_ns(void);
+
+// Run every wheel on another clock (a simulator's virtual time); NULL restores
+// CLOCK_MONOTONIC. Set it before any wheel is initialized.
+void set_clock(uint64_t (*fn)(void));
+
+// Set up an empty wheel with the given tick length
+void wheel_init(timer_wheel* wheel, uint64_t tick_us);
+
+// Prepare a timer that calls fn(arg) when it expires
+void timer_init(timer* t, void (*fn)(void*), void* arg);
+
+// (Re)arm a timer to fire delay_us from now, rounded up to whole ticks
+void timer_set(timer_wheel* wheel, timer* t, uint64_t delay_us);
+
+// Disarm a timer; does nothing if it is not pending
+void timer_cancel(timer* t);
+
+static inline bool timer_pending(timer* t){
+    return t->pprev != NULL;
+}
+
+// Run every timer that expired by now. Returns the number of timers that fired.
+int wheel_run(timer_wheel* wheel);
+
+// Clock time at which the next timer may fire; UINT64_MAX when none is pending
+uint64_t wheel_next_ns(timer_wheel* wheel);
@@ -1,4 +1,9 @@
+#include "compress.h"
 #include "consts.h"
+#include "crc32c.h"
+#include "fastopen.h"
+#include "shm.h"
+#include "transport.h"
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -10,50 +15,268 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/random.h>
+#include <sys/timerfd.h>
+
+// Connection state. It is per thread, so that one process can run several
+// connections (the simulator in sim.c runs both ends of one).
+_Thread_local int state = 0;           // Current state for handshake
+_Thread_local int our_send_window = 0; // Total number of bytes in our send buf
+_Thread_local int their_receiving_window = MIN_WINDOW;   // Receiver window size
+_Thread_local int our_max_receiving_window = MIN_WINDOW; // Our max receiving window
+_Thread_local int our_recv_window = 0;                   // Bytes in our recv buf
+_Thread_local int last_win_sent = 0;                     // Window we advertised in our last packet
+_Thread_local int drop_ceiling = MAX_WINDOW;             // Our receiving window's limit since kernel drops
+_Thread_local int drop_clean_bytes = 0;                  // Bytes received since the ceiling was last cut or raised
+_Thread_local uint32_t ack = 0;        // Acknowledgement number
+_Thread_local uint32_t seq = 0;        // Sequence number
+_Thread_local bool pure_ack = false;   // Require ACK to be sent out
+_Thread_local bool syn_sent = false;
+_Thread_local bool syn_ack_received = false;
+_Thread_local bool syn_received = false;    // Server: got the client's SYN
+_Thread_local uint32_t our_isn = 0;         // Our initial SEQ#
+_Thread_local uint32_t their_isn = 0;       // Peer's initial SEQ#
+_Thread_local packet* syn_pkt = NULL;       // Client: SYN kept for retransmission
+_Thread_local timer syn_timer;              // SYN / SYN-ACK retransmission deadline
+_Thread_local bool syn_due = false;         // syn_timer expired: retransmit the SYN / SYN-ACK
+_Thread_local int syn_rto = RTO;            // Current SYN / SYN-ACK retransmission timeout
+_Thread_local int syn_retries = 0;          // SYN / SYN-ACK retransmissions so far
+_Thread_local bool fastopen_wanted = false; // Client: send data in the SYN; server: accept it
+_Thread_local bool fastopen_data_sent = false; // Client: the SYN carried our first data packet
+_Thread_local bool send_cookie = false;     // Server: put a fast open cookie in the SYN-ACK
+_Thread_local bool fin_sent = false;        // Our FIN is out: every stream's input ended
+_Thread_local bool fin_after_peer = false;  // Our FIN went out after the peer's FIN, so it ACKs it
+_Thread_local bool fin_received = false;    // Got the peer's FIN
+_Thread_local uint32_t their_fin_seq = 0;   // SEQ# of the peer's FIN
+_Thread_local int fin_retries = 0;          // Timeout retransmissions of our FIN
+_Thread_local bool lingering = false;       // Both sides closed; waiting in case our last ACK was lost
+_Thread_local timer linger_timer;           // End of the linger period
+_Thread_local bool linger_done = false;
+_Thread_local bool drop_packet = false;
+_Thread_local bool csum_wanted = true;   // We ask for / accept end-to-end checksums
+_Thread_local bool csum_enabled = false; // Both ends agreed on checksums in the handshake
+_Thread_local bool comp_wanted = false;  // We ask for / accept stream compression
+_Thread_local bool comp_enabled = false; // Both ends agreed on compression in the handshake
+_Thread_local packet* base_pkt = NULL; // Lowest outstanding packet to be sent out
+_Thread_local transport_stats stats;   // Counters reported when the connection ends
+
+_Thread_local int fec_mode = FEC_OFF;        // FEC_OFF, FEC_ADAPTIVE or a fixed block size
+_Thread_local double loss_rate = 0;          // Moving average of retransmissions per data packet sent
+_Thread_local int fec_block = 0;             // Size of the FEC block being built
+_Thread_local int fec_count = 0;             // Data packets XORed into the block so far
+_Thread_local uint32_t fec_base = 0;         // SEQ# of the block's first data packet
+_Thread_local fec_header fec_acc_hdr;        // XOR of the block's header fields
+_Thread_local uint8_t fec_acc[MAX_PAYLOAD];  // XOR of the block's payloads
+_Thread_local uint16_t fec_acc_len = 0;      // Longest payload in the block
+_Thread_local packet* fec_pending = NULL;    // Parity packet waiting to be sent
+
+_Thread_local uint8_t fec_hist[FEC_HIST][sizeof(packet) + MAX_PAYLOAD]; // Received data packets, slot SEQ# % FEC_HIST
+_Thread_local bool fec_hist_valid[FEC_HIST];
+_Thread_local uint8_t fec_parity[FEC_PARITY][MAX_PACKET];               // Received parity packets awaiting their block
+_Thread_local bool fec_parity_valid[FEC_PARITY];
+_Thread_local int fec_parity_next = 0;       // Slot overwritten when every parity slot is taken
+
+_Thread_local buffer_node* recv_buf = NULL;       // Linked list storing out of order received packets (points to the start of the buffer)
+_Thread_local buffer_node* recv_buf_tail = NULL;  // Pointer that points to the tail of the recv_buf
+_Thread_local buffer_node* send_buf = NULL;       // Linked list storing packets that were sent but not acknowledged (points to the start of the buffer)
+_Thread_local buffer_node* send_buf_tail = NULL;  // Pointer that points to the tail of the send_buf
+
+_Thread_local stream_state streams[MAX_STREAMS]; // Per-stream sequencing, reorder and credit state
+_Thread_local int num_streams = 1;                // Streams in use: 1 until the handshake settles it
+_Thread_local int streams_wanted = 1;             // Streams the application asked for
+_Thread_local int next_stream = 0;                // Round-robin position for reading input
+
+_Thread_local subflow subflows[MAX_SUBFLOWS];    // Paths of the connection; path 0 carries the handshake
+_Thread_local int num_subflows = 1;               // Paths we offer (add_subflow)
+_Thread_local int subflows_agreed = 1;            // Paths both ends offered in the handshake
+_Thread_local int tx_subflow = 0;                 // Path of the packet get_data() returns
+_Thread_local int rx_subflow = 0;                 // Path the latest packet arrived on
+_Thread_local timer join_timer;                   // Client: join the paths the server has not answered on
+_Thread_local int join_interval = 0;              // Current join timeout
+_Thread_local uint32_t join_nonce = 0;            // From the SYN-ACK: joins must carry it to open a path
+_Thread_local uint64_t syn_sent_ns = 0;           // When the first SYN (server: SYN-ACK) went out; UINT64_MAX once the server repeated it
+_Thread_local struct sockaddr_in* peer_addr;      // Address of the other end (on path 0)
+
+_Thread_local ssize_t (*input)(uint8_t*, size_t); // Get data from layer
+_Thread_local void (*output)(uint8_t*, size_t);   // Output data from layer
+_Thread_local ssize_t (*input_stream)(uint16_t, uint8_t*, size_t); // Get data for one stream from layer
+_Thread_local void (*output_stream)(uint16_t, uint8_t*, size_t);   // Output one stream's data from layer
+
+_Thread_local timer_wheel wheel;    // Deadlines of every timer below and of each segment in send_buf
+_Thread_local timer idle_timer;     // Fires after IDLE_TIMEOUT without traffic
+_Thread_local bool idle_expired = false;
+_Thread_local bool peer_gone = false; // A segment hit MAX_RETRIES: the peer stopped answering
+
+_Thread_local uint64_t rack_xmit_ns = 0;        // RACK: send time of the latest-sent segment known delivered
+_Thread_local uint32_t rack_end_seq = 0;        // RACK: its SEQ# (orders segments sent at the same time)
+_Thread_local uint64_t rack_rtt_ns = 0;         // RACK: RTT measured on that segment
+_Thread_local uint64_t min_rtt_ns = UINT64_MAX; // Lowest RTT seen on any path
+_Thread_local uint64_t srtt_ns = 0;             // Smoothed RTT over all paths
+_Thread_local uint64_t rttvar_ns = 0;           // Its mean deviation (RFC 6298)
+_Thread_local timer rack_timer;                 // Looks for losses again once a reordering window ends
+_Thread_local timer tlp_timer;                  // Tail loss probe: resend the newest segment when ACKs stop
+_Thread_local bool msg_mode = false;        // Each data packet is one message, which may be given up on
+_Thread_local int msg_lifetime = 0;         // Message mode: give up on a message not ACKed within this long (0: never)
+_Thread_local int msg_max_retransmits = -1; // Message mode: give up instead of retransmitting more often (-1: never)
+_Thread_local bool forward_ok = false;      // The peer understands FORWARD packets
+_Thread_local timer fwd_timer;              // Send the FORWARD packet again until the peer's ACK# passes it
+_Thread_local bool fwd_due = false;         // A FORWARD packet is to be sent
+_Thread_local int fwd_interval = 0;         // Current FORWARD retransmission timeout; 0 for a new FORWARD
+_Thread_local int fwd_retries = 0;          // FORWARD retransmissions so far
+_Thread_local uint32_t fwd_point = 0;       // Forward ACK point of the last FORWARD sent
+_Thread_local uint64_t fwd_sent_ns = 0;     // When it was sent
+_Thread_local uint32_t rxq_drops_seen = 0;  // SO_RXQ_OVFL count that came with the last datagram
+_Thread_local bool shm_wanted = true;       // Use shared memory with a same-host peer
+_Thread_local int shm_sockfd = -1;          // Client: socket the server's shared-memory channel arrives on
+_Thread_local bool shm_offered = false;     // Server: we sent the client a channel; Client: we took it
+_Thread_local bool shm_on = false;          // Data goes through shared memory instead of UDP
+_Thread_local shm_channel shm;
+_Thread_local timer probe_timer;                // Window probe while the peer's window holds back new data
+_Thread_local int probe_interval = 0;           // Current window probe timeout; 0 while not probing
+_Thread_local bool probe_due = false;
+
+void segment_timeout(void* arg);
+void rack_delivered(buffer_node* node);
+void arm_tlp();
+void send_packet(int sockfd, struct sockaddr_in* addr, packet* pkt);
+void send_on_subflow(int path, packet* pkt);
+void subflow_release(buffer_node* node);
+
+// Default clock and network: CLOCK_MONOTONIC and the UDP socket
+ssize_t udp_send(int sockfd, const void* buf, size_t len, const struct sockaddr_in* addr){
+    return sendto(sockfd, buf, len, 0, (const struct sockaddr*) addr, sizeof(struct sockaddr_in));
+}
+
+// Also picks up the kernel's count of datagrams dropped on the socket's full
+// receive queue (SO_RXQ_OVFL), which comes along once it is not 0
+ssize_t udp_recv(int sockfd, void* buf, size_t len, struct sockaddr_in* addr){
+    struct iovec iov = {buf, len};
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(uint32_t))];
+    } control;
+    struct msghdr msg = {addr, sizeof(struct sockaddr_in), &iov, 1, control.buf, sizeof(control.buf), 0};
+    ssize_t bytes = recvmsg(sockfd, &msg, 0);
+
+    rxq_drops_seen = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); bytes >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL){
+            memcpy(&rxq_drops_seen, CMSG_DATA(cmsg), sizeof(uint32_t));
+        }
+    }
+    return bytes;
+}
+
+// The wheel's deadline is kept in one timerfd, armed on CLOCK_MONOTONIC in
+// absolute time, so the sleep ends on the deadline itself rather than on
+// poll()'s millisecond timeout rounded up
+_Thread_local int udp_timerfd = -1;
+
+void udp_wait(const int* sockfds, int n, uint64_t deadline_ns){
+    if (udp_timerfd < 0){
+        udp_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (udp_timerfd < 0){
+            perror("[ERROR] timerfd_create() failed");
+            exit(1);
+        }
+    }
+    struct itimerspec its = {{0, 0}, {0, 0}}; // all zero disarms it: no deadline
+    if (deadline_ns != UINT64_MAX){
+        deadline_ns = MAX(deadline_ns, 1);
+        its.it_value = (struct timespec) {deadline_ns / 1000000000, deadline_ns % 1000000000};
+    }
+    timerfd_settime(udp_timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+    struct pollfd pfds[MAX_SUBFLOWS + 1];
+    for (int i = 0; i < n; i++){
+        pfds[i] = (struct pollfd) {sockfds[i], POLLIN, 0};
+    }
+    pfds[n] = (struct pollfd) {udp_timerfd, POLLIN, 0};
+    poll(pfds, n + 1, -1);
+
+    // Drain the timerfd's expiry count, if any
+    uint64_t expirations;
+    if (pfds[n].revents & POLLIN){
+        ssize_t drained = read(udp_timerfd, &expirations, sizeof(expirations));
+        (void) drained;
+    }
+}
 
-int state = 0;           // Current state for handshake
-int our_send_window = 0; // Total number of bytes in our send buf
-int their_receiving_window = MIN_WINDOW;   // Receiver window size
-int our_max_receiving_window = MIN_WINDOW; // Our max receiving window
-int our_recv_window = 0;                   // Bytes in our recv buf
-int dup_acks = 0;        // Duplicate acknowledgements received
-uint32_t ack = 0;        // Acknowledgement number
-uint32_t seq = 0;        // Sequence number
-uint32_t temp_seq = 0;   // Save current seq#. Retreive after dup ack packet transmission
-uint32_t last_ack = 0;   // Last ACK number to keep track of duplicate ACKs
-bool pure_ack = false;   // Require ACK to be sent out
-bool syn_sent = false;
-bool syn_ack_received = false;
-bool dup_acks_retransmission = false;
-bool drop_packet = false;
-packet* base_pkt = NULL; // Lowest outstanding packet to be sent out
-
-buffer_node* recv_buf = NULL;       // Linked list storing out of order received packets (points to the start of the buffer)
-buffer_node* recv_buf_tail = NULL;  // Pointer that points to the tail of the recv_buf
-buffer_node* send_buf = NULL;       // Linked list storing packets that were sent but not acknowledged (points to the start of the buffer)
-buffer_node* send_buf_tail = NULL;  // Pointer that points to the tail of the send_buf
-
-ssize_t (*input)(uint8_t*, size_t); // Get data from layer
-void (*output)(uint8_t*, size_t);   // Output data from layer
-
-struct timeval start; // Last packet sent at this time
-struct timeval now;   // Temp for current time
+const transport_io udp_io = {NULL, udp_send, udp_recv, udp_wait};
+_Thread_local const transport_io* io = &udp_io;
 
 // HELPER FUNCTIONS
-void increment_recv_window(){
-    if (our_max_receiving_window == MAX_WINDOW){ return; }
-    if (our_max_receiving_window + 500 < MAX_WINDOW){
-        our_max_receiving_window += 500;
+// Window we advertise: what is left of our receiving window. It can be
+// below the bytes we hold once kernel drops shrank it (see kernel_drops()).
+uint16_t advertised_window(){
+    return MAX(our_max_receiving_window - our_recv_window, 0);
+}
+
+// Grow our receiving window by 500 bytes per packet received, up to the
+// ceiling kernel drops left. The ceiling rises by one packet per window of
+// data received without new drops, i.e. once per round trip while the sender
+// is held by it, like a path's cwnd after a loss.
+void increment_recv_window(int bytes){
+    if (drop_ceiling < MAX_WINDOW){
+        drop_clean_bytes += bytes;
+        if (drop_clean_bytes >= drop_ceiling){
+            drop_ceiling = MIN(drop_ceiling + MAX_PAYLOAD, MAX_WINDOW);
+            drop_clean_bytes = 0;
+        }
     }
-    else{
-        our_max_receiving_window = MAX_WINDOW;
+    our_max_receiving_window = MIN(our_max_receiving_window + 500, drop_ceiling);
+}
+// Retransmission timeout (RFC 6298): SRTT + 4 * RTTVAR, at least RTO_MIN,
+// and RTO until the first RTT sample
+int rto_us(){
+    if (srtt_ns == 0){ return RTO; }
+    uint64_t rto = (srtt_ns + MAX(4 * rttvar_ns, (uint64_t) TIMER_TICK * 1000)) / 1000;
+    return MIN(MAX(rto, RTO_MIN), RTO_MAX);
+}
+
+// Take an RTT sample of a segment sent once, or of the handshake
+void rtt_sample(uint64_t rtt){
+    min_rtt_ns = MIN(min_rtt_ns, rtt);
+    if (srtt_ns == 0){
+        srtt_ns = rtt;
+        rttvar_ns = rtt / 2;
+        return;
     }
+    uint64_t err = srtt_ns > rtt ? srtt_ns - rtt : rtt - srtt_ns;
+    rttvar_ns = rttvar_ns - rttvar_ns / 4 + err / 4;
+    srtt_ns = srtt_ns - srtt_ns / 8 + rtt / 8;
 }
+
+// Arm a segment's retransmission timer; it doubles with each timeout. In
+// message mode it fires at the message's deadline instead if that comes
+// first, to give up on it then.
+void arm_rto(buffer_node* node){
+    uint64_t delay = MIN((uint64_t) rto_us() << node->retries, RTO_MAX);
+    if (node->expires_ns != 0){
+        uint64_t now = clock_ns();
+        delay = node->expires_ns > now ? MIN(delay, (node->expires_ns - now + 999) / 1000) : 1;
+    }
+    timer_set(&wheel, &node->rto, delay);
+}
+
 void insert_send_buffer(packet* pkt){
     int payload_len = ntohs(pkt->length);
     buffer_node* node = calloc(1, sizeof(buffer_node) + payload_len);
     memcpy(&node->pkt, pkt, sizeof(packet) + payload_len);
     node->next = NULL;
+
+    // Every segment gets its own retransmission deadline
+    timer_init(&node->rto, segment_timeout, node);
+    node->retries = 0;
+    node->sent_ns = clock_ns();
+    if (msg_mode && msg_lifetime > 0 && !(pkt->flags & FIN)){
+        node->expires_ns = node->sent_ns + (uint64_t) msg_lifetime * 1000;
+    }
+    arm_rto(node);
+    node->subflow = tx_subflow;
+    node->in_flight = true;
+    subflows[tx_subflow].in_flight++;
     
     if (send_buf == NULL){
         // 1. if send_buf == NULL, insert the first packet
@@ -65,83 +288,68 @@ void insert_send_buffer(packet* pkt){
         send_buf_tail->next = node;
         send_buf_tail = send_buf_tail->next;
     }
+    arm_tlp();
 }
 
 void insert_recv_buffer(packet* pkt){
     int payload_len = ntohs(pkt->length);
-    buffer_node* node = calloc(1, sizeof(buffer_node) + payload_len);
-    memcpy(&node->pkt, pkt, sizeof(packet) + payload_len);
-    node->next = NULL;
-    uint16_t new_seq = ntohs(node->pkt.seq);  // seq # of the new recv pkt we want to insert
+    uint32_t new_seq = ntohl(pkt->seq);  // seq # of the new recv pkt we want to insert
 
-
-    if (recv_buf == NULL){  // 1. if recv_buf == NULL, insert as the first packet     
-        recv_buf = node;
-        our_recv_window += payload_len;
-        increment_recv_window();
+    // Find the first node with SEQ# >= new_seq; recv_buf stays sorted by SEQ#
+    buffer_node** link = &recv_buf;
+    while ((*link != NULL) && SEQ_LT(ntohl((*link)->pkt.seq), new_seq)){
+        link = &(*link)->next;
+    }
+    if ((*link != NULL) && (ntohl((*link)->pkt.seq) == new_seq)){
+        // do nothing if the recv pkt has already in recv_buf (recv duplicate pkts)
         return;
     }
-    else{   // 2. if recv_buf != NULL
-        // edge case: insert new recv pkt at the start of the list
-        uint16_t start_seq = ntohs(recv_buf->pkt.seq);
-        if (new_seq < start_seq){
-            node->next = recv_buf;
-            recv_buf = node;
-            our_recv_window += payload_len;
-            increment_recv_window();
-            return;
-        }
 
-        buffer_node* traverse_ptr = recv_buf;
-        buffer_node* prev_ptr;
-        uint16_t curr_seq = ntohs(traverse_ptr->pkt.seq);
-        // traverse until we reach end of list or new_seq < curr_seq
-        while ((traverse_ptr->next != NULL) && (new_seq > curr_seq)){
-            // track with two pointers
-            prev_ptr = traverse_ptr;
-            traverse_ptr = traverse_ptr->next;
-            curr_seq = ntohs(traverse_ptr->pkt.seq);
-        }
-    
-        if (traverse_ptr->next == NULL){
-            // a. insert new recv pkt at the end of the list
-            traverse_ptr->next = node;
-        }
-        else if (new_seq < curr_seq){
-            // b. insert new recv pkt in the middle of the list
-            prev_ptr->next = node;
-            node->next = traverse_ptr;
-        }
-        else if (new_seq == curr_seq){
-            // c. do nothing if the recv pkt has already in recv_buf (recv duplicate pkts)
-            return;
-        }
-        our_recv_window += payload_len;
-        increment_recv_window();
-    }    
+    buffer_node* node = calloc(1, sizeof(buffer_node) + payload_len);
+    memcpy(&node->pkt, pkt, sizeof(packet) + payload_len);
+    node->next = *link;
+    *link = node;
+
+    streams[ntohs(pkt->stream)].buffered += payload_len;
+    our_recv_window += payload_len;
+    increment_recv_window(payload_len);
 }
 
 // Remove packet with SEQ# < ACK# from send buffer
 void remove_packets_from_send_buffer(uint32_t ack){
-    while ((send_buf != NULL) && (ntohs(send_buf->pkt.seq) < ack)){
+    buffer_node* head = send_buf;
+    while ((send_buf != NULL) && SEQ_LT(ntohl(send_buf->pkt.seq), ack)){
 
         uint16_t pkt_length = ntohs(send_buf->pkt.length);
         our_send_window -= pkt_length;
+        streams[ntohs(send_buf->pkt.stream)].in_flight -= pkt_length;
 
-        fprintf(stderr, "[DEBUG] Remove packet %u from send buffer.\n", ntohs(send_buf->pkt.seq));
+        fprintf(stderr, "[DEBUG] Remove packet %u from send buffer.\n", ntohl(send_buf->pkt.seq));
         buffer_node* temp = send_buf;
         send_buf = send_buf->next;
+        timer_cancel(&temp->rto);
+        if (!temp->sacked && !temp->abandoned){ rack_delivered(temp); }
         
         free(temp);
     }
+
+    // A message we gave up on is now the oldest: tell the peer to skip it
+    if (send_buf != head){
+        timer_cancel(&fwd_timer);
+        if (send_buf != NULL && send_buf->abandoned){
+            fwd_due = true;
+            fwd_interval = 0;
+            fwd_retries = 0;
+        }
+    }
 }
 
 // Find packet with specific SEQ# in send buffer
-packet* find_pkt_in_send_buf(uint16_t seq){
+packet* find_pkt_in_send_buf(uint32_t seq){
     buffer_node* traverse_ptr = send_buf;
     if (traverse_ptr == NULL){ return NULL;  }
     while (traverse_ptr!= NULL){
-        uint16_t curr_seq = ntohs(traverse_ptr->pkt.seq);
+        uint32_t curr_seq = ntohl(traverse_ptr->pkt.seq);
         if (curr_seq == seq){
             return &traverse_ptr->pkt;
         }
@@ -161,9 +369,9 @@ bool is_in_recv_buf(uint32_t target_seq){
     if (recv_buf == NULL){ return false; }
 
     buffer_node* traverse_ptr = recv_buf;
-    uint16_t curr_seq;
+    uint32_t curr_seq;
     while (traverse_ptr != NULL){
-        curr_seq = ntohs(traverse_ptr->pkt.seq);
+        curr_seq = ntohl(traverse_ptr->pkt.seq);
         if (curr_seq == target_seq){ return true; }
         traverse_ptr = traverse_ptr->next;
     }
@@ -175,58 +383,325 @@ bool is_in_recv_buf(uint32_t target_seq){
 // 2. If packets are consecutively in-order, return last packet's SEQ# + 1 as the updated ACK#
 void adjust_ack(){
     buffer_node* traverse_ptr = recv_buf;
-    uint16_t curr_seq;
-    uint16_t next_seq;
+    uint32_t curr_seq;
+    uint32_t next_seq;
     if (traverse_ptr == NULL){ return; }
     while (traverse_ptr->next != NULL){
-        curr_seq = ntohs(traverse_ptr->pkt.seq);
-        next_seq = ntohs(traverse_ptr->next->pkt.seq);
+        curr_seq = ntohl(traverse_ptr->pkt.seq);
+        next_seq = ntohl(traverse_ptr->next->pkt.seq);
         // Case 1
-        if (next_seq != curr_seq + 1){
-            ack = curr_seq + 1;
+        if (next_seq != SEQ_ADD(curr_seq, 1)){
+            ack = SEQ_ADD(curr_seq, 1);
             return;
         }
         traverse_ptr = traverse_ptr->next;
     }
     // Case 2
-    ack = ntohs(traverse_ptr->pkt.seq) + 1;
+    ack = SEQ_ADD(ntohl(traverse_ptr->pkt.seq), 1);
     return;
 }
 
-// Scan and write out in order/acked packets in recv_buff
+// Write out a packet's payload to its stream; the stream continues after it
+void deliver_node(buffer_node* node){
+    uint16_t stream = ntohs(node->pkt.stream);
+    uint payload_len = ntohs(node->pkt.length);
+    if (comp_enabled){
+        decompress_output(stream, node->pkt.payload, payload_len);
+    }
+    else{
+        output_stream(stream, node->pkt.payload, payload_len);
+    }
+    fprintf(stderr,"[DEBUG] Output RECV BUF with SEQ# %u (stream %u)\n", ntohl(node->pkt.seq), stream);
+
+    node->delivered = true;
+    streams[stream].expected_sseq = ntohs(node->pkt.sseq) + 1;
+    streams[stream].buffered -= payload_len;
+    our_recv_window -= payload_len;
+}
+
+// Scan recv_buf and write out every packet that is next in its own stream, then
+// free packets the cumulative ACK has passed. A gap only holds back the stream it
+// belongs to: packets of one stream sit in recv_buf in SEQ# order, so a single
+// pass delivers everything that a newly filled gap unblocks.
 void output_recv_buffer(){
     
     if (recv_buf == NULL){ return; }
-    while(recv_buf != NULL){
+    bool delivered_any = false;
+    for (buffer_node* node = recv_buf; node != NULL; node = node->next){
+        if (node->delivered){ continue; }
+        if (node->pkt.flags & FIN){ // carries no stream data
+            node->delivered = true;
+            continue;
+        }
 
-        uint16_t curr_seq = ntohs(recv_buf->pkt.seq);
-        if (curr_seq < ack){
-            uint payload_len = ntohs(recv_buf->pkt.length);
-            // output(recv_buf->pkt.payload, payload_len);
-            fprintf(stderr,"[DEBUG] Output RECV BUF with SEQ# %u\n", ntohs(recv_buf->pkt.seq));
-            print_buf(recv_buf, RECV);
+        uint16_t stream = ntohs(node->pkt.stream);
+        if (ntohs(node->pkt.sseq) != streams[stream].expected_sseq){ continue; }
 
-            buffer_node* temp = recv_buf;
-            recv_buf = recv_buf->next;
+        deliver_node(node);
+        delivered_any = true;
+    }
+
+    // Every packet below the cumulative ACK has been delivered by the pass above
+    while ((recv_buf != NULL) && SEQ_LT(ntohl(recv_buf->pkt.seq), ack)){
+        buffer_node* temp = recv_buf;
+        recv_buf = recv_buf->next;
+        free(temp);
+    }
+    if (delivered_any){ print_buf(recv_buf, RECV); }
+
+    // Our window grew noticeably since we last advertised it: tell the sender
+    // now rather than when it next hears from us
+    if (advertised_window() >= last_win_sent + WINDOW_UPDATE){
+        pure_ack = true;
+    }
+}
 
-            our_recv_window -= payload_len;
-            free(temp);
+// Steps a-c of receiving a data packet: buffer it and advance our ACK#.
+// Returns false for an old packet we have already ACKed.
+bool accept_data_packet(packet* pkt){
+    uint32_t their_seq = ntohl(pkt->seq);
+    if (their_seq == 0){ return true; } // a pure ACK: it has no SEQ#
+
+    // a. Decide if we need to send a pure ack packet when there's no input later
+    // b. Place new packet into recv buffer
+    if (SEQ_GEQ(their_seq, ack)){ 
+        pure_ack = true; 
+        insert_recv_buffer(pkt);
+        print_buf(recv_buf, RECV);
+    }
+
+    // c. Update ACK# for outgoing packet
+    if (their_seq == ack){ // we receive what we want
+        ack = SEQ_ADD(their_seq, 1);
+        if (is_in_recv_buf(ack)){
+            fprintf(stderr, "ack (before): %u\n", ack);
+            fprintf(stderr, "adjust ack\n");
+            adjust_ack();
+            fprintf(stderr, "ack (after): %u\n", ack);
         }
-        else{
-            break;
+    }
+    else if (SEQ_LT(their_seq, ack)){
+        // We do not need to process the received packet if its an old packet that we've already acked before.
+        // ACK it again though: the peer resends it because our ACK got lost.
+        pure_ack = true;
+        return false;
+    }
+    // if their_seq > ack, we don't need to update ACK# (just leave ack as before)
+    return true;
+}
+
+// FORWARD packet: the sender gave up on every message below the new point
+// that we are missing. Write out what was waiting behind those messages,
+// continue each stream after them, and move our ACK# past them.
+void process_forward(packet* pkt){
+    uint16_t length = ntohs(pkt->length);
+    if (length < sizeof(forward_header)){ return; }
+    forward_header* fwd = (forward_header*) pkt->payload;
+    forward_stream* entries = (forward_stream*) (fwd + 1);
+    int n = MIN(ntohs(fwd->count), (length - sizeof(forward_header)) / sizeof(forward_stream));
+    uint32_t fwd_seq = ntohl(fwd->seq);
+
+    pure_ack = true; // ACK it even when it is old: our ACK of it may have been lost
+    if (SEQ_LEQ(fwd_seq, ack)){ return; }
+
+    // Every packet below the point is either here or will never come
+    int held = 0;
+    for (buffer_node* node = recv_buf; node != NULL && SEQ_LT(ntohl(node->pkt.seq), fwd_seq); node = node->next){
+        if (SEQ_LT(ntohl(node->pkt.seq), ack)){ continue; }
+        held++;
+        if (!node->delivered && !(node->pkt.flags & FIN)){ deliver_node(node); }
+    }
+    for (int i = 0; i < n; i++){
+        uint16_t stream = ntohs(entries[i].stream);
+        if (stream >= num_streams){ continue; }
+        uint16_t sseq = ntohs(entries[i].sseq);
+        if ((int16_t) (sseq - streams[stream].expected_sseq) > 0){ streams[stream].expected_sseq = sseq; }
+    }
+    stats.msgs_skipped += fwd_seq - ack - held;
+    fprintf(stderr, "[DEBUG] Forward ACK point %u: skipping %d messages.\n", fwd_seq, fwd_seq - ack - held);
+
+    ack = fwd_seq;
+    if (is_in_recv_buf(ack)){ adjust_ack(); }
+    output_recv_buffer();
+}
+
+// FEC block size for the next block: either fixed, or sized from the loss rate
+// so that a block rarely loses more than the one packet its parity can rebuild
+int next_fec_block(){
+    if (fec_mode != FEC_ADAPTIVE){ return fec_mode; }
+    if (loss_rate < 1.0 / (8 * FEC_MAX_BLOCK)){ return FEC_OFF; }
+    int block = (int) (1.0 / (4 * loss_rate));
+    return MAX(FEC_MIN_BLOCK, MIN(block, FEC_MAX_BLOCK));
+}
+
+// XOR a new data packet into the current block; once the block is full,
+// prepare its parity packet to go out next
+void fec_add(packet* pkt){
+    if (fec_count == 0){
+        fec_block = next_fec_block();
+        if (fec_block == FEC_OFF){ return; }
+        fec_base = ntohl(pkt->seq);
+        memset(&fec_acc_hdr, 0, sizeof(fec_header));
+        memset(fec_acc, 0, MAX_PAYLOAD);
+        fec_acc_len = 0;
+    }
+
+    uint16_t payload_len = ntohs(pkt->length);
+    fec_acc_hdr.length_x ^= payload_len;
+    fec_acc_hdr.stream_x ^= ntohs(pkt->stream);
+    fec_acc_hdr.sseq_x ^= ntohs(pkt->sseq);
+    for (int i = 0; i < payload_len; i++){
+        fec_acc[i] ^= pkt->payload[i];
+    }
+    fec_acc_len = MAX(fec_acc_len, payload_len);
+    fec_count++;
+
+    if (fec_count < fec_block){ return; }
+
+    // Block complete: build its parity packet
+    packet* parity = calloc(1, sizeof(packet) + sizeof(fec_header) + fec_acc_len);
+    parity->seq = htonl(fec_base);
+    parity->length = htons(sizeof(fec_header) + fec_acc_len);
+    parity->flags = ACK | FEC;
+    fec_header* hdr = (fec_header*) parity->payload;
+    hdr->count = htons(fec_count);
+    hdr->length_x = htons(fec_acc_hdr.length_x);
+    hdr->stream_x = htons(fec_acc_hdr.stream_x);
+    hdr->sseq_x = htons(fec_acc_hdr.sseq_x);
+    memcpy(parity->payload + sizeof(fec_header), fec_acc, fec_acc_len);
+
+    free(fec_pending); // never happens with blocks of 2+ packets, but don't leak
+    fec_pending = parity;
+    fec_count = 0;
+}
+
+// Keep a copy of a received data packet in case a parity packet needs it
+void fec_record(packet* pkt){
+    int slot = ntohl(pkt->seq) % FEC_HIST;
+    memcpy(fec_hist[slot], pkt, sizeof(packet) + ntohs(pkt->length));
+    fec_hist_valid[slot] = true;
+}
+
+packet* fec_lookup(uint32_t target_seq){
+    int slot = target_seq % FEC_HIST;
+    packet* pkt = (packet*) fec_hist[slot];
+    if (!fec_hist_valid[slot] || ntohl(pkt->seq) != target_seq){ return NULL; }
+    return pkt;
+}
+
+// Rebuild the one missing packet of every block whose other packets all arrived.
+// A rebuilt packet may complete another block, so repeat until nothing changes.
+void fec_recover(){
+    bool progress = true;
+    while (progress){
+        progress = false;
+        for (int i = 0; i < FEC_PARITY; i++){
+            if (!fec_parity_valid[i]){ continue; }
+            packet* parity = (packet*) fec_parity[i];
+            fec_header* hdr = (fec_header*) parity->payload;
+            uint32_t base = ntohl(parity->seq);
+            uint16_t count = ntohs(hdr->count);
+
+            // Block entirely behind our ACK#: nothing left to repair
+            if (SEQ_LEQ(SEQ_ADD(base, count), ack)){
+                fec_parity_valid[i] = false;
+                continue;
+            }
+
+            int missing = 0;
+            uint32_t missing_seq = 0;
+            for (uint32_t s = base; s != SEQ_ADD(base, count); s = SEQ_ADD(s, 1)){
+                if (fec_lookup(s) == NULL){
+                    missing++;
+                    missing_seq = s;
+                }
+            }
+            if (missing != 1 || SEQ_LT(missing_seq, ack)){ continue; }
+
+            // XOR the parity with every packet we have to get the missing one back
+            uint16_t parity_len = ntohs(parity->length) - sizeof(fec_header);
+            uint16_t length = ntohs(hdr->length_x);
+            uint16_t stream = ntohs(hdr->stream_x);
+            uint16_t sseq = ntohs(hdr->sseq_x);
+            uint8_t payload[MAX_PAYLOAD];
+            memcpy(payload, parity->payload + sizeof(fec_header), parity_len);
+            for (uint32_t s = base; s != SEQ_ADD(base, count); s = SEQ_ADD(s, 1)){
+                packet* have = fec_lookup(s);
+                if (have == NULL){ continue; }
+                uint16_t have_len = ntohs(have->length);
+                length ^= have_len;
+                stream ^= ntohs(have->stream);
+                sseq ^= ntohs(have->sseq);
+                for (int j = 0; j < have_len; j++){
+                    payload[j] ^= have->payload[j];
+                }
+            }
+            fec_parity_valid[i] = false;
+            if (length > parity_len || stream >= num_streams){ continue; } // corrupt block
+
+            packet* pkt = calloc(1, sizeof(packet) + length);
+            pkt->seq = htonl(missing_seq);
+            pkt->length = htons(length);
+            pkt->flags = ACK;
+            pkt->stream = htons(stream);
+            pkt->sseq = htons(sseq);
+            memcpy(pkt->payload, payload, length);
+
+            fprintf(stderr, "\nFEC RECOVERED packet # %u\n", missing_seq);
+            stats.fec_recovered++;
+            fec_record(pkt);
+            accept_data_packet(pkt);
+            free(pkt);
+            progress = true;
         }
     }
 }
 
+// Hold on to a parity packet until its block can be repaired or is complete
+void fec_store_parity(packet* pkt){
+    int slot = -1;
+    for (int i = 0; i < FEC_PARITY && slot < 0; i++){
+        if (!fec_parity_valid[i]){ slot = i; }
+    }
+    if (slot < 0){
+        slot = fec_parity_next;
+        fec_parity_next = (fec_parity_next + 1) % FEC_PARITY;
+    }
+    memcpy(fec_parity[slot], pkt, sizeof(packet) + ntohs(pkt->length));
+    fec_parity_valid[slot] = true;
+}
+
 packet* generate_pure_ack_packet(){
     // respond with pure ACK
-    packet* pkt = calloc(1,sizeof(packet));
-    pkt->seq = htons(0);
-    pkt->ack = htons(ack);
+    packet* pkt = calloc(1,sizeof(packet) + SACK_BLOCKS * sizeof(sack_block));
+    pkt->seq = htonl(0);
+    pkt->ack = htonl(ack);
     pkt->length = htons(0); 
-    pkt->win = htons(our_max_receiving_window-our_recv_window);  
+    pkt->win = htons(advertised_window());  
     pkt->flags = ACK;
-    pkt->unused = htons(0);
+    pkt->stream = htons(0);
+    pkt->sseq = htons(0);
+    pkt->subflows = 0;
+
+    // List the runs we hold above our ACK# so the sender resends only the holes
+    sack_block* blocks = (sack_block*) pkt->payload;
+    int n = 0;
+    for (buffer_node* node = recv_buf; node != NULL; node = node->next){
+        uint32_t node_seq = ntohl(node->pkt.seq);
+        if (SEQ_LT(node_seq, ack)){ continue; }
+        if (n > 0 && ntohl(blocks[n - 1].end) == node_seq){
+            blocks[n - 1].end = htonl(SEQ_ADD(node_seq, 1));
+            continue;
+        }
+        if (n == SACK_BLOCKS){ break; }
+        blocks[n].start = htonl(node_seq);
+        blocks[n].end = htonl(SEQ_ADD(node_seq, 1));
+        n++;
+    }
+    if (n > 0){
+        pkt->flags |= SACK;
+        pkt->length = htons(n * sizeof(sack_block));
+    }
 
     fprintf(stderr,"\nPURE ACK:\n");
     print_diag(pkt, SEND);
@@ -235,23 +710,795 @@ packet* generate_pure_ack_packet(){
     return pkt;
 }
 
+// Send a pure ACK on a path, with SACK blocks if we hold packets above our ACK#
+void send_pure_ack(int path){
+    packet* pure_ack_pkt = generate_pure_ack_packet();
+    send_on_subflow(path, pure_ack_pkt);
+    free(pure_ack_pkt);
+    pure_ack = false;
+}
+
+// Whether recv_buf holds packets above a gap at our ACK#
+bool recv_buf_has_holes(){
+    for (buffer_node* node = recv_buf; node != NULL; node = node->next){
+        if (SEQ_GT(ntohl(node->pkt.seq), ack)){ return true; }
+    }
+    return false;
+}
+
+packet* copy_packet(packet* original_pkt){
+    int payload_len = ntohs(original_pkt->length);
+    packet* pkt = calloc(1, sizeof(packet) + payload_len);
+    memcpy(pkt, original_pkt, sizeof(packet) + payload_len);
+    return pkt;
+}
+
+// Number of paths we currently send on
+int active_subflows(){
+    int n = 0;
+    for (int i = 0; i < num_subflows; i++){
+        if (subflows[i].active){ n++; }
+    }
+    return n;
+}
+
+// Lowest-RTT active path other than `avoid` (-1: any), or `avoid` itself if
+// no other path is active
+int fastest_subflow(int avoid){
+    int best = -1;
+    for (int i = 0; i < num_subflows; i++){
+        if (!subflows[i].active || i == avoid){ continue; }
+        if (best < 0 || subflows[i].srtt_ns < subflows[best].srtt_ns){ best = i; }
+    }
+    if (best < 0){ return avoid >= 0 ? avoid : 0; }
+    return best;
+}
+
+// Scheduler: the path for the next new data packet, or -1 while every path
+// must wait. Of the paths that are not pacing and have room in their window,
+// the one with the lowest RTT goes first, so the slower paths carry what the
+// faster ones have no capacity for. A single path is only paced.
+int pick_subflow(){
+    bool multipath = active_subflows() > 1;
+    int best = -1;
+    for (int i = 0; i < num_subflows; i++){
+        subflow* sf = &subflows[i];
+        if (!sf->active || timer_pending(&sf->pace)){ continue; }
+        if (multipath && sf->in_flight >= (int) sf->cwnd){ continue; }
+        if (best < 0 || sf->srtt_ns < subflows[best].srtt_ns){ best = i; }
+    }
+    return best;
+}
+
+// Path for a pure ACK: the one the latest packet arrived on, which is known
+// to work and mostly carries the ACK back the way the data came
+int ack_subflow(){
+    return subflows[rx_subflow].active ? rx_subflow : fastest_subflow(-1);
+}
+
+// Stop counting a segment in the window of the path it was last sent on
+void subflow_release(buffer_node* node){
+    if (!node->in_flight){ return; }
+    subflows[node->subflow].in_flight--;
+    node->in_flight = false;
+}
+
+// A segment sent on a path was lost: halve the path's window, at most once
+// per round trip (losses of segments sent before the last cut are the same event)
+void subflow_loss(buffer_node* node){
+    subflow* sf = &subflows[node->subflow];
+    if (node->sent_ns <= sf->recovery_ns){ return; }
+    sf->cwnd = MAX(sf->cwnd / 2, SUBFLOW_MIN_CWND);
+    sf->recovery_ns = clock_ns();
+}
+
+// A segment sent on a path timed out: start the path's window over. After
+// SUBFLOW_TIMEOUTS timeouts in a row, stop using the path while others work.
+void subflow_timeout(int path){
+    subflow* sf = &subflows[path];
+    sf->cwnd = SUBFLOW_MIN_CWND;
+    sf->recovery_ns = clock_ns();
+    if (++sf->timeouts >= SUBFLOW_TIMEOUTS && sf->active && active_subflows() > 1){
+        sf->active = false;
+        fprintf(stderr, "[INFO] Subflow %d stopped delivering; not using it anymore.\n", path);
+    }
+}
+
+// Whether a packet is a join that carries the nonce of this connection
+bool valid_join(packet* pkt){
+    return (pkt->flags & MPATH) && !(pkt->flags & SYN) && ntohs(pkt->length) == JOIN_NONCE_LEN &&
+           memcmp(pkt->payload, &join_nonce, JOIN_NONCE_LEN) == 0;
+}
+
+// A valid packet arrived on a path from address from. Paths other than 0 take
+// packets only from the peer's address on them; a server learns that address
+// from a join carrying the nonce of its SYN-ACK, and nothing else opens the
+// path. Returns false for a packet to drop.
+bool subflow_heard(int path, packet* pkt, const struct sockaddr_in* from){
+    subflow* sf = &subflows[path];
+    if (path == 0){
+        sf->addr = *from;
+    }
+    else if (!sf->bound){
+        if (path >= subflows_agreed || !valid_join(pkt)){ return false; }
+        sf->addr = *from;
+        sf->bound = true;
+    }
+    else if (from->sin_addr.s_addr != sf->addr.sin_addr.s_addr || from->sin_port != sf->addr.sin_port){
+        return false;
+    }
+
+    rx_subflow = path;
+    if (!sf->active && path < subflows_agreed && sf->timeouts < SUBFLOW_TIMEOUTS){
+        sf->active = true;
+        fprintf(stderr, "[INFO] Subflow %d is up (peer port %u).\n", path, ntohs(sf->addr.sin_port));
+    }
+    // Answer a join on its own path, so the client knows the path works
+    if (valid_join(pkt) && sf->active){
+        send_pure_ack(path);
+    }
+    return true;
+}
+
+// Client: open the other paths the handshake agreed on. A join is a pure ACK
+// with the MPATH flag and the nonce from the SYN-ACK as its payload; the server
+// learns our address on the path from it and answers on the same path. Joins go out again, with backoff, until the
+// server is heard on every path or SYN_RETRIES joins went unanswered.
+void send_joins(void* arg){
+    (void) arg;
+    bool waiting = false;
+    for (int i = 1; i < subflows_agreed; i++){
+        subflow* sf = &subflows[i];
+        if (sf->active || sf->join_retries > SYN_RETRIES){ continue; }
+        if (sf->join_retries++ == SYN_RETRIES){
+            fprintf(stderr, "[INFO] No answer on subflow %d; not using it.\n", i);
+            continue;
+        }
+        packet* pkt = generate_pure_ack_packet();
+        pkt->flags = (pkt->flags & ~SACK) | MPATH; // the nonce instead of SACK blocks
+        pkt->length = htons(JOIN_NONCE_LEN);
+        memcpy(pkt->payload, &join_nonce, JOIN_NONCE_LEN);
+        send_on_subflow(i, pkt);
+        free(pkt);
+        waiting = true;
+    }
+    if (!waiting){ return; }
+    timer_set(&wheel, &join_timer, join_interval);
+    join_interval = MIN(join_interval * 2, RTO);
+}
+
+// Copy a segment in send_buf for retransmission with our current ACK# and
+// window, and restart its send time and retransmission deadline. It goes out
+// on the fastest path other than the one it was lost on, if there is one.
+packet* retransmit_segment(buffer_node* node){
+    packet* pkt = copy_packet(&node->pkt);
+    pkt->ack = htonl(ack);
+    pkt->win = htons(advertised_window());
+
+    subflow_release(node);
+    tx_subflow = fastest_subflow(node->subflow);
+    node->subflow = tx_subflow;
+    node->in_flight = true;
+    subflows[tx_subflow].in_flight++;
+
+    node->sent_ns = clock_ns();
+    node->retransmitted = true;
+    node->retransmits++;
+    node->lost = false;
+    arm_rto(node);
+
+    stats.retransmits++;
+    loss_rate += (1 - loss_rate) / 64;
+    return pkt;
+}
+
+// Message mode: whether to give up on a segment rather than send it again,
+// because its message expired or used up its retransmissions. Only done when
+// the peer understands the FORWARD packet that tells it to stop waiting.
+bool give_up(buffer_node* node){
+    if (!msg_mode || !forward_ok || node->sacked || node->abandoned || (node->pkt.flags & FIN)){ return false; }
+    bool expired = node->expires_ns != 0 && clock_ns() >= node->expires_ns;
+    bool retries_used = msg_max_retransmits >= 0 && node->retransmits >= msg_max_retransmits;
+    if (!expired && !retries_used){ return false; }
+
+    node->abandoned = true;
+    node->lost = false;
+    timer_cancel(&node->rto);
+    subflow_release(node);
+    stats.msgs_abandoned++;
+    fprintf(stderr, "[DEBUG] Giving up on message %u (%s).\n", ntohl(node->pkt.seq),
+            expired ? "expired" : "retransmission limit");
+    if (node == send_buf){
+        fwd_due = true;
+        fwd_interval = 0;
+        fwd_retries = 0;
+    }
+    return true;
+}
+
+// Longest wait between FORWARD retransmissions. The messages sent behind a
+// lost FORWARD wait for it at the peer, so it must not take longer than a
+// message may live.
+int fwd_max_interval(){
+    return msg_lifetime > 0 ? MIN(msg_lifetime, RTO) : RTO;
+}
+
+// Build a FORWARD packet for the messages we gave up on at the head of
+// send_buf: the peer no longer waits for anything below the first segment we
+// still deliver. It is sent again, with backoff, until the peer's ACK# passes
+// that point.
+packet* build_forward_packet(){
+    uint32_t fwd_seq = SEQ_ADD(seq, 1);
+    for (buffer_node* node = send_buf; node != NULL; node = node->next){
+        if (!node->abandoned){
+            fwd_seq = ntohl(node->pkt.seq);
+            break;
+        }
+    }
+
+    packet* pkt = calloc(1, sizeof(packet) + sizeof(forward_header) + MAX_STREAMS * sizeof(forward_stream));
+    forward_header* fwd = (forward_header*) pkt->payload;
+    forward_stream* entries = (forward_stream*) (fwd + 1);
+    int n = 0;
+    for (buffer_node* node = send_buf; node != NULL && SEQ_LT(ntohl(node->pkt.seq), fwd_seq); node = node->next){
+        uint16_t stream = ntohs(node->pkt.stream);
+        int i = 0;
+        while (i < n && ntohs(entries[i].stream) != stream){ i++; }
+        if (i == n){ n++; }
+        entries[i].stream = htons(stream);
+        entries[i].sseq = htons(ntohs(node->pkt.sseq) + 1);
+    }
+    fwd->seq = htonl(fwd_seq);
+    fwd->count = htons(n);
+    fwd_point = fwd_seq;
+    fwd_sent_ns = clock_ns();
+
+    pkt->seq = htonl(0);
+    pkt->ack = htonl(ack);
+    pkt->length = htons(sizeof(forward_header) + n * sizeof(forward_stream));
+    pkt->win = htons(advertised_window());
+    pkt->flags = ACK | FORWARD;
+    pkt->subflows = 0;
+
+    if (fwd_interval == 0){ fwd_interval = MAX(2 * srtt_ns / 1000, TLP_MIN); }
+    else { fwd_interval *= 2; }
+    fwd_interval = MIN(fwd_interval, fwd_max_interval());
+    timer_set(&wheel, &fwd_timer, fwd_interval);
+
+    fprintf(stderr, "\nFORWARD ACK point to %u\n", fwd_seq);
+    print_diag(pkt, SEND);
+    fprintf(stderr, "\n");
+    return pkt;
+}
+
+// A segment in send_buf reached its deadline without being ACKed: resend it
+// right away and restart its timer, independently of every other segment
+void segment_timeout(void* arg){
+    buffer_node* node = arg;
+    if (give_up(node)){ return; }
+    if (++node->retries > MAX_RETRIES){
+        peer_gone = true;
+        return;
+    }
+    subflow_timeout(node->subflow);
+    packet* pkt = retransmit_segment(node);
+    send_on_subflow(node->subflow, pkt);
+
+    fprintf(stderr, "\nRETRANSMIT packet # %u after timeout\n", ntohl(pkt->seq));
+    if ((pkt->flags & FIN) && node == send_buf){ fin_retries++; } // only once all data is ACKed
+    print_diag(pkt, SEND);
+    fprintf(stderr, "\n");
+    free(pkt);
+
+    timer_set(&wheel, &idle_timer, IDLE_TIMEOUT);
+}
+
+// RACK: a segment reached the peer. Its send time is what losses are judged
+// by: a segment sent before it and still missing is late, not reordered.
+// Each path also keeps its own RTTs, since paths differ in delay.
+void rack_delivered(buffer_node* node){
+    subflow* sf = &subflows[node->subflow];
+    uint64_t rtt = clock_ns() - node->sent_ns;
+
+    // The path delivers: its window grows by one packet per window of ACKs
+    subflow_release(node);
+    sf->timeouts = 0;
+    sf->cwnd = MIN(sf->cwnd + 1.0 / sf->cwnd, MAX_WINDOW / MAX_PAYLOAD);
+
+    // An ACK faster than any RTT seen belongs to an earlier transmission
+    if (node->retransmitted && sf->min_rtt_ns != UINT64_MAX && rtt < sf->min_rtt_ns){ return; }
+    if (!node->retransmitted){
+        rtt_sample(rtt);
+        sf->min_rtt_ns = MIN(sf->min_rtt_ns, rtt);
+        sf->srtt_ns = sf->srtt_ns == 0 ? rtt : sf->srtt_ns - sf->srtt_ns / 8 + rtt / 8;
+    }
+
+    uint32_t node_seq = ntohl(node->pkt.seq);
+    if (node->sent_ns > rack_xmit_ns || (node->sent_ns == rack_xmit_ns && SEQ_GT(node_seq, rack_end_seq))){
+        rack_xmit_ns = node->sent_ns;
+        rack_end_seq = node_seq;
+        rack_rtt_ns = rtt;
+    }
+    if (node->sent_ns > sf->rack_xmit_ns || (node->sent_ns == sf->rack_xmit_ns && SEQ_GT(node_seq, sf->rack_end_seq))){
+        sf->rack_xmit_ns = node->sent_ns;
+        sf->rack_end_seq = node_seq;
+        sf->rack_rtt_ns = rtt;
+    }
+}
+
+// RACK: a segment is lost once a segment sent after it was delivered and it
+// has been out for longer than that segment's RTT plus a reordering window.
+// Every segment that qualifies is marked at once, so all holes of a window
+// are resent in the same round trip; rack_timer checks the others again when
+// their reordering window ends. With several paths, a segment is given the
+// RTT of its own path: a later segment may well arrive first over a faster one.
+void rack_detect_loss(){
+    if (rack_xmit_ns == 0){ return; }
+    uint64_t now = clock_ns();
+    uint64_t wait_ns = UINT64_MAX;
+    for (buffer_node* node = send_buf; node != NULL; node = node->next){
+        if (node->sacked || node->lost || node->abandoned){ continue; }
+        uint32_t node_seq = ntohl(node->pkt.seq);
+        if (node->sent_ns > rack_xmit_ns || (node->sent_ns == rack_xmit_ns && SEQ_GEQ(node_seq, rack_end_seq))){
+            continue; // not sent before the latest delivered segment
+        }
+
+        // A path without an RTT sample yet is left to the timers
+        subflow* sf = &subflows[node->subflow];
+        if (sf->rack_xmit_ns == 0){ continue; }
+        uint64_t rtt = sf->rack_rtt_ns;
+        uint64_t reo_wnd = (sf->min_rtt_ns == UINT64_MAX ? rtt : sf->min_rtt_ns) / REO_WND_DIV;
+        // Paths are read in turns, so packets may reorder by a loop round or two
+        if (active_subflows() > 1){ reo_wnd = MAX(reo_wnd, (uint64_t) TIMER_TICK * 1000); }
+        // With FEC on, give the block's parity packet time to repair a hole first
+        if (fec_mode != FEC_OFF){ reo_wnd += (uint64_t) fec_block * PACE_INTERVAL * 1000; }
+        uint64_t deadline = node->sent_ns + rtt + reo_wnd;
+        if (deadline <= now){
+            node->lost = true;
+            subflow_loss(node);
+            fprintf(stderr, "[DEBUG] RACK: packet %u is lost.\n", node_seq);
+        }
+        else{
+            wait_ns = MIN(wait_ns, deadline - now);
+        }
+    }
+    if (wait_ns != UINT64_MAX){ timer_set(&wheel, &rack_timer, wait_ns / 1000 + 1); }
+}
+
+// The peer's window holds back new data. Its window update may be lost, so
+// send a packet with an already ACKed SEQ#, which the peer always ACKs again
+// (with its current window). The probe timeout doubles up to the RTO.
+packet* window_probe(){
+    if (probe_interval == 0){
+        probe_interval = MAX(2 * srtt_ns / 1000, PROBE_MIN);
+        timer_set(&wheel, &probe_timer, probe_interval);
+        return NULL;
+    }
+    if (!probe_due || send_buf == NULL){ return NULL; }
+    probe_due = false;
+
+    packet* pkt = calloc(1, sizeof(packet));
+    uint32_t probe_seq = ntohl(send_buf->pkt.seq) - 1;
+    pkt->seq = htonl(probe_seq != 0 ? probe_seq : probe_seq - 1); // 0 would make it a pure ACK
+    pkt->ack = htonl(ack);
+    pkt->length = htons(0);
+    pkt->win = htons(advertised_window());
+    pkt->flags = ACK;
+    pkt->subflows = 0;
+
+    probe_interval = MIN(probe_interval * 2, rto_us());
+    timer_set(&wheel, &probe_timer, probe_interval);
+
+    fprintf(stderr, "\nWINDOW PROBE (window %d, %d bytes in flight)\n", their_receiving_window, our_send_window);
+    print_diag(pkt, SEND);
+    fprintf(stderr, "\n");
+    return pkt;
+}
+
+// Tail loss probe: RACK needs a later segment to be delivered, which never
+// happens when the newest segments are lost or nothing newer can be sent.
+// Two SRTTs after the last new segment or ACK, resend the newest segment the
+// peer does not hold; its ACK exposes any loss before it.
+void arm_tlp(){
+    if (send_buf == NULL || srtt_ns == 0){
+        timer_cancel(&tlp_timer);
+        return;
+    }
+    timer_set(&wheel, &tlp_timer, MAX(2 * srtt_ns / 1000, TLP_MIN));
+}
+
+void tlp_expired(void* arg){
+    (void) arg;
+    buffer_node* newest = NULL;
+    for (buffer_node* node = send_buf; node != NULL; node = node->next){
+        if (!node->sacked && !node->abandoned){ newest = node; }
+    }
+    if (newest == NULL || newest->lost){ return; }
+    newest->lost = true;
+    fprintf(stderr, "[DEBUG] Tail loss probe: packet %u.\n", ntohl(newest->pkt.seq));
+}
+
+// Mark segments covered by the SACK blocks of a pure ACK as delivered. They
+// stay in send_buf until the cumulative ACK passes them, but are not resent.
+void process_sack(packet* pkt){
+    int n = MIN((int) (ntohs(pkt->length) / sizeof(sack_block)), SACK_BLOCKS);
+    sack_block* blocks = (sack_block*) pkt->payload;
+    for (buffer_node* node = send_buf; node != NULL; node = node->next){
+        if (node->sacked){ continue; }
+        uint32_t node_seq = ntohl(node->pkt.seq);
+        for (int i = 0; i < n; i++){
+            if (SEQ_GEQ(node_seq, ntohl(blocks[i].start)) && SEQ_LT(node_seq, ntohl(blocks[i].end))){
+                node->sacked = true;
+                node->lost = false;
+                timer_cancel(&node->rto);
+                rack_delivered(node);
+                break;
+            }
+        }
+    }
+}
+
+// Read up to MAX_PAYLOAD bytes of input. Streams are visited round-robin,
+// skipping those that used up their own credit, so one busy stream cannot
+// starve the others. Returns the bytes read and the stream they belong to.
+ssize_t read_input(uint8_t* buffer, size_t max_length, uint16_t* stream_out){
+    for (int i = 0; i < num_streams; i++){
+        uint16_t stream = (next_stream + i) % num_streams;
+        if (streams[stream].in_flight >= STREAM_WINDOW){ continue; }
+        if (streams[stream].input_done){ continue; }
+        ssize_t bytes_read = comp_enabled ? compress_input(stream, buffer, max_length)
+                                          : input_stream(stream, buffer, max_length);
+        if (bytes_read < 0){
+            streams[stream].input_done = true;
+            fprintf(stderr, "[DEBUG] End of input on stream %u.\n", stream);
+        }
+        else if (bytes_read > 0){
+            next_stream = (stream + 1) % num_streams;
+            *stream_out = stream;
+            return bytes_read;
+        }
+    }
+    return 0;
+}
+
+// Generate the next data packet and buffer it until it is ACKed
+packet* build_data_packet(uint16_t stream, uint8_t* buffer, ssize_t bytes_read){
+    packet* pkt = calloc(1,sizeof(packet) + bytes_read);
+
+    seq = SEQ_ADD(seq, 1);
+    pkt->seq = htonl(seq);
+    pkt->ack = htonl(ack);
+    pkt->length = htons(bytes_read);  
+    pkt->win = htons(advertised_window());  
+    pkt->flags = ACK;
+    pkt->stream = htons(stream);
+    pkt->sseq = htons(streams[stream].next_sseq++);
+    pkt->subflows = 0;
+    memcpy(pkt->payload, buffer, bytes_read);
+
+    insert_send_buffer(pkt);
+    our_send_window += bytes_read;
+    streams[stream].in_flight += bytes_read;
+    stats.data_sent++;
+    loss_rate -= loss_rate / 64;
+    fec_add(pkt);
+    return pkt;
+}
+
+// Whether every stream's input has ended
+bool all_input_done(){
+    for (int i = 0; i < num_streams; i++){
+        if (!streams[i].input_done){ return false; }
+    }
+    return true;
+}
+
+// Whether the peer's FIN and everything before it has arrived. Receiving the
+// FIN alone is not enough: data still missing before it is not ACKed yet.
+bool peer_closed(){
+    return fin_received && SEQ_GT(ack, their_fin_seq);
+}
+
+// Build a FIN after our last data packet. It takes the next SEQ# and stays in
+// send_buf until ACKed, so the peer knows all data before it has arrived.
+packet* build_fin_packet(){
+    packet* pkt = calloc(1, sizeof(packet));
+    seq = SEQ_ADD(seq, 1);
+    pkt->seq = htonl(seq);
+    pkt->ack = htonl(ack);
+    pkt->length = htons(0);
+    pkt->win = htons(advertised_window());
+    pkt->flags = ACK | FIN;
+    pkt->subflows = 0;
+
+    insert_send_buffer(pkt);
+    fin_sent = true;
+    fin_after_peer = peer_closed(); // then our FIN's ACK# covers the peer's FIN
+    fprintf(stderr, "\n");
+    print_diag(pkt, SEND);
+    return pkt;
+}
+
+// Whether both directions are finished and we can exit. If our FIN went out
+// before the peer's FIN arrived, the peer's FIN is ACKed only by a later pure
+// ACK; linger briefly to ACK it again in case that ACK is lost.
+bool connection_closed(){
+    if (!(fin_sent && send_buf == NULL && peer_closed())){ return false; }
+    if (fin_after_peer){ return true; }
+
+    if (!lingering){
+        lingering = true;
+        timer_set(&wheel, &linger_timer, LINGER * rto_us());
+        return false;
+    }
+    return linger_done;
+}
+
+// Build a SYN packet for handshake (1). With fast open and a cookie from an
+// earlier connection, the SYN also carries the cookie and our first data
+// packet, which the server can deliver before the handshake completes.
+packet* build_syn_packet(){
+    packet* pkt = calloc(1, sizeof(packet) + COOKIE_LEN + MAX_PAYLOAD);
+    pkt->seq = htonl(seq);
+    pkt->ack = htonl(0);
+    pkt->length = htons(0);
+    pkt->win = htons(our_max_receiving_window);
+    pkt->flags = SYN;
+    if (csum_wanted){ pkt->flags |= CSUM; }
+    if (comp_wanted){ pkt->flags |= COMP; }
+    pkt->flags |= FORWARD;
+    pkt->subflows = 0;
+    pkt->streams = streams_wanted;
+    if (num_subflows > 1){
+        pkt->flags |= MPATH;
+        pkt->subflows = num_subflows;
+    }
+
+    uint8_t cookie[COOKIE_LEN];
+    if (!fastopen_wanted){ return pkt; }
+    pkt->flags |= FASTOPEN;
+    if (!fastopen_load_cookie(peer_addr, cookie)){ return pkt; } // empty payload asks for a cookie
+
+    memcpy(pkt->payload, cookie, COOKIE_LEN);
+    pkt->length = htons(COOKIE_LEN);
+
+    // Compression is not agreed on yet, so data only rides along without it
+    if (comp_wanted){ return pkt; }
+    uint8_t buffer[MAX_PAYLOAD];
+    uint16_t stream = 0;
+    ssize_t bytes_read = read_input(buffer, MAX_PAYLOAD, &stream);
+    if (bytes_read == 0){ return pkt; }
+
+    // The data gets the SEQ# it would have after the handshake: ISN+1 is used
+    // by the handshake ACK
+    seq = our_isn + 1;
+    packet* data = build_data_packet(stream, buffer, bytes_read);
+    pkt->stream = data->stream;
+    pkt->sseq = data->sseq;
+    memcpy(pkt->payload + COOKIE_LEN, data->payload, bytes_read);
+    pkt->length = htons(COOKIE_LEN + bytes_read);
+    free(data);
+    fastopen_data_sent = true;
+    return pkt;
+}
+
+// Build a SYN-ACK packet for handshake (2), with a fast open cookie if asked
+packet* build_syn_ack_packet(){
+    packet* pkt = calloc(1, sizeof(packet) + COOKIE_LEN + JOIN_NONCE_LEN);
+    pkt->seq = htonl(seq);
+    pkt->ack = htonl(ack);
+    pkt->length = htons(0);
+    pkt->win = htons(our_max_receiving_window);
+    pkt->flags = comp_enabled ? SYN | ACK | COMP : SYN | ACK;
+    pkt->flags |= FORWARD;
+    if (shm_offered){ pkt->flags |= SHM; }
+    pkt->subflows = 0;
+    pkt->streams = num_streams;
+    if (subflows_agreed > 1){
+        pkt->flags |= MPATH;
+        pkt->subflows = subflows_agreed;
+    }
+    if (send_cookie){
+        pkt->flags |= FASTOPEN;
+        pkt->length = htons(COOKIE_LEN);
+        fastopen_cookie(peer_addr, pkt->payload);
+    }
+    // After the cookie, if any: the nonce the client's joins must carry
+    if (subflows_agreed > 1){
+        memcpy(pkt->payload + ntohs(pkt->length), &join_nonce, JOIN_NONCE_LEN);
+        pkt->length = htons(ntohs(pkt->length) + JOIN_NONCE_LEN);
+    }
+
+    timer_set(&wheel, &syn_timer, syn_rto);
+    print_diag(pkt, SEND);
+    fprintf(stderr, "\n");
+    return pkt;
+}
+
+// Whether the SYN / SYN-ACK is due for retransmission (RTO doubles each time)
+bool syn_timeout(){
+    if (!syn_due){ return false; }
+    syn_due = false;
+    syn_retries++;
+    syn_rto *= 2;
+    timer_set(&wheel, &syn_timer, syn_rto);
+    return true;
+}
+
+// Server: take the data a client sent in its SYN, if its cookie is valid.
+// It becomes the client's first data packet (SEQ# ISN+2).
+void accept_fast_open(packet* pkt){
+    send_cookie = true;
+    uint16_t length = ntohs(pkt->length);
+    if (length < COOKIE_LEN){ return; } // cookie request
+    if (!fastopen_cookie_valid(peer_addr, pkt->payload)){
+        fprintf(stderr, "[DEBUG] Invalid fast open cookie; sending a fresh one.\n");
+        return;
+    }
+    if (length == COOKIE_LEN || ntohs(pkt->stream) >= num_streams){ return; }
+
+    uint16_t payload_len = length - COOKIE_LEN;
+    packet* data = calloc(1, sizeof(packet) + payload_len);
+    data->seq = htonl(their_isn + 2);
+    data->length = htons(payload_len);
+    data->flags = ACK;
+    data->stream = pkt->stream;
+    data->sseq = pkt->sseq;
+    memcpy(data->payload, pkt->payload + COOKIE_LEN, payload_len);
+
+    fprintf(stderr, "[DEBUG] Fast open: accepted %u bytes from the SYN.\n", payload_len);
+    ack = their_isn + 2;
+    accept_data_packet(data);
+    output_recv_buffer();
+    free(data);
+}
+
+// Whether the peer runs on this host, so that it can share memory with us
+bool same_host(const struct sockaddr_in* addr){
+    return io == &udp_io && (ntohl(addr->sin_addr.s_addr) >> 24) == 127;
+}
+
+// Client: offer shared memory to a same-host server. Not with data in the
+// SYN (fast open): the server would take it from UDP, and we could not tell.
+void offer_shm(packet* syn){
+    if (!shm_wanted || fastopen_data_sent || !same_host(peer_addr)){ return; }
+
+    // Our UDP port names the socket the channel arrives on: bind now to learn it
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    if (getsockname(subflows[0].sockfd, (struct sockaddr*) &local, &len) < 0){ return; }
+    if (local.sin_port == 0){
+        struct sockaddr_in any = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY), .sin_port = 0};
+        bind(subflows[0].sockfd, (struct sockaddr*) &any, sizeof(any));
+        len = sizeof(local);
+        if (getsockname(subflows[0].sockfd, (struct sockaddr*) &local, &len) < 0){ return; }
+    }
+    shm_sockfd = shm_listen(ntohs(local.sin_port));
+    if (shm_sockfd >= 0){ syn->flags |= SHM; }
+}
+
+// Client: take the server's shared-memory channel once it has arrived. The
+// server moves over only when we confirm, with SHM on our handshake ACK or,
+// should that be lost, with the first record in the ring.
+bool accept_shm(){
+    if (shm_sockfd < 0 || !shm_accept(shm_sockfd, &shm)){ return false; }
+    shm_sockfd = -1;
+    shm_offered = true;
+    uint8_t none = 0;
+    shm_send(&shm, SHM_TAKEN, &none, 0);
+    return true;
+}
+
+// Server: the client answered our offer. With SHM it took the channel and the
+// connection moves over; without it, it stays on UDP and the channel goes.
+void shm_answered(bool taken){
+    if (!shm_offered || shm_on){ return; }
+    if (taken){
+        shm_on = true;
+        return;
+    }
+    fprintf(stderr, "[INFO] The client did not take the shared-memory channel; staying on UDP.\n");
+    shm_close(&shm);
+    shm_offered = false;
+}
+
+// Same-host peer: stream data goes through the shared-memory rings. They
+// neither lose nor reorder anything, so there are no SEQ#s, ACKs or
+// retransmissions, and a full ring holds the writer back like a closed
+// window. Each record is what one input call returned, so messages stay whole.
+void shm_loop(){
+    fprintf(stderr, "[INFO] Same-host peer: moving data through shared memory.\n");
+    size_t chunk = msg_mode ? MAX_PAYLOAD : SHM_CHUNK;
+    uint8_t* buffer = malloc(SHM_CHUNK);
+    bool peer_done = false;
+    uint64_t last_progress_ns = clock_ns();
+
+    while (!(fin_sent && peer_done)){
+        bool progress = false;
+
+        // 1. Write out what the peer sent; a bounded batch, so we also get to send
+        uint16_t stream;
+        ssize_t len;
+        for (int i = 0; i < SHM_BATCH && (len = shm_recv(&shm, &stream, buffer, SHM_CHUNK)) >= 0; i++){
+            progress = true;
+            if (stream == SHM_FIN){
+                peer_done = true;
+                break;
+            }
+            if (stream >= num_streams){ continue; }
+            if (comp_enabled){
+                decompress_output(stream, buffer, len);
+            }
+            else{
+                output_stream(stream, buffer, len);
+            }
+        }
+
+        // 2. Read input while the ring has room for a full record, then end our direction
+        for (int i = 0; i < SHM_BATCH && !fin_sent && shm_space(&shm) >= chunk; i++){
+            ssize_t bytes_read = read_input(buffer, chunk, &stream);
+            if (bytes_read > 0){
+                shm_send(&shm, stream, buffer, bytes_read);
+                progress = true;
+                continue;
+            }
+            if (all_input_done()){
+                shm_send(&shm, SHM_FIN, buffer, 0);
+                fin_sent = true;
+                progress = true;
+            }
+            break;
+        }
+
+        // 3. Sleep until the peer writes or frees room; input is polled every PACE_INTERVAL
+        if (progress){
+            last_progress_ns = clock_ns();
+            continue;
+        }
+        if (clock_ns() - last_progress_ns >= IDLE_TIMEOUT * 1000ULL){
+            fprintf(stderr, "[INFO] Idle timeout reached. Exiting.\n");
+            break;
+        }
+        bool room = shm_space(&shm) >= chunk;
+        shm_wait(&shm, fin_sent || room ? 0 : chunk, fin_sent || !room ? IDLE_TIMEOUT : PACE_INTERVAL);
+    }
+    if (fin_sent && peer_done){ fprintf(stderr, "[INFO] Connection closed. Exiting.\n"); }
+    free(buffer);
+}
+
 // Prepare data to send out
 packet* get_data() {
 
+    tx_subflow = 0; // the handshake runs on path 0
     switch (state) {
     case SERVER_AWAIT: {
+        // A client that took our channel and whose ACK got lost still wrote to it
+        if (shm_offered && shm_readable(&shm)){
+            shm_answered(true);
+            break;
+        }
+        // Retransmit the SYN-ACK until the client's ACK arrives
+        if (syn_received && syn_retries < SYN_RETRIES && syn_timeout()){
+            fprintf(stderr, "\nRETRANSMIT SYN-ACK\n");
+            return build_syn_ack_packet();
+        }
         break;
     }
     case CLIENT_AWAIT: {
         // Build a ACK to reply for server's SYN-ACK for handshake (3)   
-        if (syn_ack_received){
+        if (syn_ack_received && !shm_on){
             packet* pkt = calloc(1, sizeof(packet));
-            pkt->seq = htons(seq);
-            pkt->ack = htons(ack);
+            pkt->seq = htonl(our_isn + 1);
+            pkt->ack = htonl(ack);
             pkt->length = htons(0); 
             pkt->win = htons(our_max_receiving_window);  
             pkt->flags = ACK;
-            pkt->unused = htons(0);
+            pkt->subflows = 0;
+            // Confirm the server's channel; the connection moves over once this is out
+            if (shm_offered){
+                pkt->flags |= SHM;
+                shm_on = true;
+            }
 
             state = NORMAL;
             print_diag(pkt, SEND);
@@ -259,98 +1506,99 @@ packet* get_data() {
 
             return pkt; 
         }   
+
+        // Retransmit the SYN until the SYN-ACK arrives
+        if (syn_timeout()){
+            if (syn_retries > SYN_RETRIES){
+                fprintf(stderr, "[ERROR] No SYN-ACK from server after %d retransmissions.\n", SYN_RETRIES);
+                exit(1);
+            }
+            fprintf(stderr, "\nRETRANSMIT SYN\n");
+            print_diag(syn_pkt, SEND);
+            return copy_packet(syn_pkt);
+        }
         break;
     }
     case CLIENT_START: {
 
         // Build a SYN packet for handshake (1)
-        if (!syn_sent){ // ensure that SYN packet is only sent once
-            packet* pkt = calloc(1, sizeof(packet));
-            pkt->seq = htons(seq);
-            pkt->ack = htons(0);
-            pkt->length = htons(0);
-            pkt->win = htons(our_max_receiving_window);
-            pkt->flags = SYN;
-            pkt->unused = htons(0);
-
+        if (!syn_sent){ // the SYN is built once, then retransmitted from syn_pkt
+            syn_pkt = build_syn_packet();
+            offer_shm(syn_pkt);
             state = CLIENT_AWAIT;
+            syn_sent = true;
+            syn_sent_ns = clock_ns();
+            timer_set(&wheel, &syn_timer, syn_rto);
 
-            syn_sent = true;  // used so that SYN packet will only be sent once
-
-            print_diag(pkt, SEND);
+            print_diag(syn_pkt, SEND);
             fprintf(stderr, "\n");
-            return pkt;
+            return copy_packet(syn_pkt);
         }
         break;
     }
     case SERVER_START:{
-
-        // Build a SYN-ACK packet for handshake (2)
-        packet* pkt = calloc(1, sizeof(packet));
-        pkt->seq = htons(seq);
-        pkt->ack = htons(ack);
-        pkt->length = htons(0);
-        pkt->win = htons(our_max_receiving_window);
-        pkt->flags = SYN | ACK;
-        pkt->unused = htons(0);
-
+        // Build a SYN-ACK packet for handshake (2). Once it went out twice, the
+        // client's ACK no longer times the round trip.
         state = SERVER_AWAIT;
-
-        print_diag(pkt, SEND);
-        fprintf(stderr, "\n");
-        return pkt;
-        break;
+        syn_sent_ns = syn_sent_ns == 0 ? clock_ns() : UINT64_MAX;
+        return build_syn_ack_packet();
     }
     case NORMAL: {
 
         drop_packet = false;
-        // Retransmit dup-acked packet
-        if (dup_acks_retransmission){
-
-            // Find pkt in send_buf for retransmission
-            packet* original_pkt = find_pkt_in_send_buf(seq);
-            if (original_pkt == NULL){ return NULL; } // dup-acked packet cannot be found in send_buf, send nothing
-
-            // Make a deep copy of original packet
-            int payload_len = ntohs(original_pkt->length);
-            packet* pkt = calloc(1, sizeof(packet) + payload_len);
-            memcpy(pkt, original_pkt, sizeof(packet) + payload_len);
-
-            // Modify ACK before sending
-            pkt->ack = htons(ack);
-            pkt->win = htons(our_max_receiving_window-our_recv_window);  
+        // Retransmit every packet RACK judged lost, back to back
+        for (buffer_node* node = send_buf; node != NULL; node = node->next){
+            if (!node->lost || give_up(node)){ continue; }
+            packet* pkt = retransmit_segment(node);
 
-            fprintf(stderr, "\nFAST RETRANSMIT packet # %hu\n", ntohs(pkt->seq));
+            fprintf(stderr, "\nFAST RETRANSMIT packet # %u\n", ntohl(pkt->seq));
             print_diag(pkt, SEND);
             fprintf(stderr, "\n");
+            return pkt;
+        }
+
+        // Tell the peer to stop waiting for messages we gave up on
+        if (fwd_due){
+            fwd_due = false;
+            if (send_buf != NULL && send_buf->abandoned){
+                tx_subflow = fastest_subflow(-1);
+                return build_forward_packet();
+            }
+        }
 
-            if (temp_seq != 0){ seq = temp_seq; }
-            dup_acks_retransmission = false; 
-            dup_acks = 0;  // reset
+        // Send the parity packet of the block we just finished
+        if (fec_pending != NULL){
+            packet* pkt = fec_pending;
+            fec_pending = NULL;
+            tx_subflow = fastest_subflow(-1);
+            pkt->ack = htonl(ack);
+            pkt->win = htons(advertised_window());
 
+            stats.fec_sent++;
+            print_diag(pkt, SEND);
             return pkt;
         }
 
+        // New data goes out at most once per PACE_INTERVAL on each path
+        int path = pick_subflow();
+        if (path < 0){ return NULL; }
+
         // Read data from STDIN only when receiver's window size is greater than our unACKed bytes
         if (their_receiving_window >= our_send_window){
+            timer_cancel(&probe_timer);
+            probe_interval = 0;
+            probe_due = false;
+
             uint8_t buffer[MAX_PAYLOAD];
-            ssize_t bytes_read = input(buffer, MAX_PAYLOAD);
+            uint16_t stream = 0;
+            tx_subflow = path;
+            ssize_t bytes_read = read_input(buffer, MAX_PAYLOAD, &stream);
+            if (!all_input_done()){ timer_set(&wheel, &subflows[path].pace, PACE_INTERVAL); } // also polls input again
+            if (bytes_read == 0 && !fin_sent && all_input_done()){ return build_fin_packet(); }
             if (bytes_read == 0){ return NULL; }  // return NULL packet if we have no data (from STDIN) to send yet
             else{ 
                 // Generate packet with payload
-                packet* pkt = calloc(1,sizeof(packet) + bytes_read);
-
-                seq += 1;
-                pkt->seq = htons(seq);
-                pkt->ack = htons(ack);
-                pkt->length = htons(bytes_read);  
-                pkt->win = htons(our_max_receiving_window-our_recv_window);  
-                pkt->flags = ACK;
-                pkt->unused = htons(0);
-                memcpy(pkt->payload, buffer, bytes_read);
-
-                insert_send_buffer(pkt);
-                our_send_window += bytes_read;
+                packet* pkt = build_data_packet(stream, buffer, bytes_read);
 
                 // DEBUG: drop pkt
                 if (seq == 303 || seq == 307){ 
@@ -374,7 +1622,10 @@ packet* get_data() {
                 return pkt;
             }
         }
-        else{ return NULL; } // return NULL packet if we don't have enough quota now
+        else{ // no quota now: at most a window probe
+            tx_subflow = fastest_subflow(-1);
+            return window_probe();
+        }
 
         break;
     }
@@ -398,88 +1649,164 @@ void recv_data(packet* pkt) {
     }
     case SERVER_AWAIT:{
 
-        uint16_t client_seq = ntohs(pkt->seq);
-        uint16_t client_ack = ntohs(pkt->ack);
-        ack = client_seq + 1;
-        if (pkt->flags == SYN){   // Receive hanshake SYN from client
+        uint32_t client_seq = ntohl(pkt->seq);
+        if (pkt->flags & SYN){   // Receive hanshake SYN from client
+            if (!syn_received){
+                syn_received = true;
+                their_isn = client_seq;
+                ack = SEQ_ADD(client_seq, 1);
+                csum_enabled = csum_wanted && (pkt->flags & CSUM);
+                comp_enabled = comp_wanted && (pkt->flags & COMP);
+                forward_ok = pkt->flags & FORWARD;
+                num_streams = MAX(1, MIN(streams_wanted, pkt->streams));
+                if (pkt->flags & MPATH){
+                    subflows_agreed = MAX(1, MIN(num_subflows, pkt->subflows));
+                    if (subflows_agreed > 1 && getrandom(&join_nonce, sizeof(join_nonce), 0) != sizeof(join_nonce)){
+                        perror("[ERROR] getrandom() failed; using one path only");
+                        subflows_agreed = 1;
+                    }
+                }
+                if (fastopen_wanted && (pkt->flags & FASTOPEN)){
+                    accept_fast_open(pkt);
+                }
+                // A same-host client: send it a shared-memory channel before our SYN-ACK
+                if (shm_wanted && (pkt->flags & SHM) && same_host(peer_addr)){
+                    shm_offered = shm_offer(ntohs(peer_addr->sin_port), &shm);
+                }
+            }
+            // A retransmitted SYN means our SYN-ACK was lost: send it again
             state = SERVER_START;
         }
-        else if (pkt->flags == ACK){
-            last_ack = client_ack;
+        else if ((pkt->flags & ACK) && syn_received){
+            // The handshake ACK (SEQ# ISN+1), or a data packet that overtook a lost one
             their_receiving_window = ntohs(pkt->win);
+            if (SEQ_LT(ack, SEQ_ADD(their_isn, 2))){ ack = SEQ_ADD(their_isn, 2); }
             state = NORMAL;
+            timer_cancel(&syn_timer);
+            if (syn_retries == 0 && syn_sent_ns != UINT64_MAX){ rtt_sample(clock_ns() - syn_sent_ns); }
+            shm_answered(pkt->flags & SHM);
+            if (ntohs(pkt->length) > 0){
+                recv_data(pkt);
+            }
         }
         break;
     }
     case CLIENT_AWAIT: {
-        if (pkt->flags == (SYN | ACK)){
-            uint16_t server_seq = ntohs(pkt->seq);
-            uint16_t server_ack = ntohs(pkt->ack);
-            seq = server_ack;      // 301
-            ack = server_seq + 1;  // 501
-            last_ack = server_ack; // 301
+        if ((pkt->flags & (SYN | ACK)) == (SYN | ACK)){
+            csum_enabled = csum_wanted && (pkt->flags & CSUM);
+            comp_enabled = comp_wanted && (pkt->flags & COMP);
+            forward_ok = pkt->flags & FORWARD;
+            num_streams = MAX(1, MIN(streams_wanted, pkt->streams));
+            uint32_t server_seq = ntohl(pkt->seq);
+            uint32_t server_ack = ntohl(pkt->ack);
+            ack = SEQ_ADD(server_seq, 1);  // 501
+            if (!fastopen_data_sent){
+                seq = server_ack;  // 301
+            }
+            else if (SEQ_GT(server_ack, seq)){
+                // The server took the data in our SYN
+                remove_packets_from_send_buffer(server_ack);
+            }
+            else{
+                // Data in the SYN was refused (stale cookie): send it again right away
+                if (send_buf != NULL){ send_buf->lost = true; }
+            }
 
+            if ((pkt->flags & FASTOPEN) && ntohs(pkt->length) >= COOKIE_LEN){
+                fastopen_store_cookie(peer_addr, pkt->payload);
+            }
+            if ((pkt->flags & SHM) && !accept_shm()){
+                fprintf(stderr, "[INFO] Could not take the server's shared-memory channel; staying on UDP.\n");
+            }
+            if (shm_sockfd >= 0){ // the server did not take the offer
+                close(shm_sockfd);
+                shm_sockfd = -1;
+            }
+            free(syn_pkt);
+            syn_pkt = NULL;
             syn_ack_received = true;
+            timer_cancel(&syn_timer);
+            if (syn_retries == 0){ rtt_sample(clock_ns() - syn_sent_ns); }
+
+            // Join the other paths, timing the joins by the handshake's round trip
+            size_t nonce_at = (pkt->flags & FASTOPEN) ? COOKIE_LEN : 0;
+            if ((pkt->flags & MPATH) && ntohs(pkt->length) >= nonce_at + JOIN_NONCE_LEN){
+                memcpy(&join_nonce, pkt->payload + nonce_at, JOIN_NONCE_LEN);
+                subflows_agreed = MAX(1, MIN(num_subflows, pkt->subflows));
+                join_interval = syn_retries == 0 ? MAX(2 * (clock_ns() - syn_sent_ns) / 1000, PROBE_MIN) : RTO;
+                send_joins(NULL);
+            }
         }
         break;
     }
     case NORMAL: {
-        uint16_t their_seq = ntohs(pkt->seq);
-        uint16_t their_ack = ntohs(pkt->ack);
+        uint32_t their_seq = ntohl(pkt->seq);
+        uint32_t their_ack = ntohl(pkt->ack);
+
+        // A repeated SYN-ACK means our handshake ACK was lost: ACK again
+        if (pkt->flags & SYN){
+            pure_ack = true;
+            return;
+        }
         their_receiving_window = htons(pkt->win);
-        
-        // a. Decide if we need to send a pure ack packet when there's no input later
-        // b. Place new packet into recv buffer
-        if (their_seq >= ack){ 
-            pure_ack = true; 
-            insert_recv_buffer(pkt);
-            print_buf(recv_buf, RECV);
-        }
-
-        // c. Update ACK# for outgoing packet
-        if (their_seq == ack){ // we receive what we want
-            ack = their_seq + 1;
-            if (is_in_recv_buf(ack)){
-                fprintf(stderr, "ack (before): %u\n", ack);
-                fprintf(stderr, "adjust ack\n");
-                adjust_ack();
-                fprintf(stderr, "ack (after): %u\n", ack);
+
+        // Parity packets only repair data; their ACK# is not counted
+        if (pkt->flags & FEC){
+            uint16_t parity_len = ntohs(pkt->length);
+            if (parity_len >= sizeof(fec_header) && parity_len <= sizeof(fec_header) + MAX_PAYLOAD){
+                fec_store_parity(pkt);
+                fec_recover();
+                output_recv_buffer();
             }
-        }
-        else if (their_seq < ack && their_seq != 0){
-            // We do not need to process the received packet if its an old packet that we've already acked before
             return;
         }
-        // if their_seq == 0, // we receive a pure ACK.
-        // if their_seq > ack, we don't need to update ACK# (just leave ack as before)
 
+        // Mark packets the peer holds above its ACK# (SACK blocks of a pure ACK)
+        if (pkt->flags & SACK){
+            process_sack(pkt);
+        }
 
+        // If ACK flag is set, remove packets with SEQ# < received ACK# from send_buf.
+        // Every packet carries this, whatever happens to its payload below.
+        if ((pkt->flags & (SYN | ACK)) == ACK){
+            fprintf(stderr, "[DEBUG] Remove packets with SEQ# < %u.\n", their_ack);
+            remove_packets_from_send_buffer(their_ack);
+            print_buf(send_buf, SEND);
 
-        // d. Check if we need to retransmit a dup-acked packet. Update/reset SEQ# for outgoing packet if needed
-        // fprintf(stderr, "their_ack: %u\n", their_ack);
-        // fprintf(stderr, "last_ack: %u\n", last_ack);
-        if (their_ack == last_ack){ // Receive dup ack
-            dup_acks++;
-            fprintf(stderr, "[DEBUG] their_ack == last_ack, dup_acks = %d\n", dup_acks);
-            if (dup_acks == DUP_ACKS){ 
-                temp_seq = seq;
-                seq = their_ack;
-                dup_acks_retransmission = true; 
-                fprintf(stderr, "dup_acks_retransmission = true\n");
+            // The peer answered after our FORWARD should have reached it, yet still
+            // waits below the point: the FORWARD was lost, send it again now
+            if (timer_pending(&fwd_timer) && SEQ_LT(their_ack, fwd_point) && clock_ns() - fwd_sent_ns > srtt_ns * 5 / 4){
+                fwd_due = true;
             }
         }
-        
-        // e. If ACK flag is set, remove packets with SEQ# < received ACK# from send_buf 
-        if (pkt->flags == ACK){
-            fprintf(stderr, "[DEBUG] Remove packets with SEQ# < %d.\n", their_ack);
-            remove_packets_from_send_buffer(their_ack);
-            print_buf(send_buf, SEND);
+
+        // Resend every packet that a later delivered one shows to be lost
+        rack_detect_loss();
+        arm_tlp();
+
+        // The sender gave up on messages: stop waiting for them. Its ACK# and
+        // window were taken above like those of any other packet.
+        if (pkt->flags & FORWARD){
+            process_forward(pkt);
+            return;
         }
 
+        // Ignore data for streams we do not track
+        if (ntohs(pkt->stream) >= num_streams){ return; }
+
+        // a-c. Buffer new data and update ACK# for outgoing packet
+        if (their_seq != 0 && ntohs(pkt->length) > 0){
+            fec_record(pkt);
+        }
+        if (!accept_data_packet(pkt)){ return; }
+        if ((pkt->flags & FIN) && !fin_received){
+            fin_received = true;
+            their_fin_seq = their_seq;
+        }
+        fec_recover();
+
         // f. Linear scan recv_buf and write out acked packets
         output_recv_buffer();
-        last_ack = their_ack;
-        // fprintf(stderr, "last ack (at the end): %u\n", last_ack);
 
         break;
     }
@@ -489,31 +1816,290 @@ void recv_data(packet* pkt) {
     }
 }
 
-// Main function of transport layer; never quits
+// Checksum the packet (once both ends agreed on it) and send it to the peer
+void send_packet(int sockfd, struct sockaddr_in* addr, packet* pkt){
+    if (csum_enabled){ pkt->flags |= CSUM; }
+    if (pkt->flags & CSUM){
+        pkt->csum = 0;
+        pkt->csum = htonl(crc32c(0, pkt, sizeof(packet) + ntohs(pkt->length)));
+    }
+
+    last_win_sent = ntohs(pkt->win);
+
+    ssize_t sent_bytes = io->send(sockfd, pkt, sizeof(packet) + ntohs(pkt->length), addr);
+    if (sent_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+        perror("[ERROR] sendto() failed to send data to socket.\n");
+        exit(1);
+    }
+}
+
+// Send a packet on one path
+void send_on_subflow(int path, packet* pkt){
+    subflow* sf = &subflows[path];
+    sf->packets_sent++;
+    send_packet(sf->sockfd, &sf->addr, pkt);
+}
+
+// Make a socket buffer hold at least `bytes` (the kernel doubles what we ask
+// for, for its bookkeeping). Never shrinks it; past net.core.rmem_max/wmem_max
+// only a privileged process gets more. Returns the resulting size, 0 if unknown.
+int grow_socket_buffer(int sockfd, int opt, int force_opt, int bytes){
+    int size = 0;
+    socklen_t len = sizeof(size);
+    if (getsockopt(sockfd, SOL_SOCKET, opt, &size, &len) < 0){ return 0; }
+    if (size >= bytes){ return size; }
+
+    setsockopt(sockfd, SOL_SOCKET, opt, &bytes, sizeof(bytes));
+    getsockopt(sockfd, SOL_SOCKET, opt, &size, &len);
+    if (size < bytes && setsockopt(sockfd, SOL_SOCKET, force_opt, &bytes, sizeof(bytes)) == 0){
+        getsockopt(sockfd, SOL_SOCKET, opt, &size, &len);
+    }
+    if (size < bytes){
+        fprintf(stderr, "[INFO] Socket %s buffer capped at %d bytes (wanted %d); raise net.core.%s.\n",
+                opt == SO_RCVBUF ? "receive" : "send", size, bytes, opt == SO_RCVBUF ? "rmem_max" : "wmem_max");
+    }
+    return size;
+}
+
+// Size a path's socket buffers from the window: the peer may send a full
+// window at once, and ACKs, parity packets and retransmissions ride along.
+// Also ask the kernel to report datagrams it drops on a full receive queue.
+void size_socket_buffers(subflow* sf){
+    int bytes = 2 * (MAX_WINDOW / MAX_PAYLOAD) * SOCKBUF_PER_PACKET;
+    sf->rcvbuf = grow_socket_buffer(sf->sockfd, SO_RCVBUF, SO_RCVBUFFORCE, bytes);
+    grow_socket_buffer(sf->sockfd, SO_SNDBUF, SO_SNDBUFFORCE, bytes);
+    setsockopt(sf->sockfd, SOL_SOCKET, SO_RXQ_OVFL, &(int) {1}, sizeof(int));
+}
+
+// The kernel dropped datagrams on a path's full receive queue. That is our
+// own overflow, not network loss: count it, grow the socket's receive buffer,
+// and halve the window we advertise, right away, so the sender slows down
+// instead of running into retransmission timeouts. The halved window is also
+// the ceiling it grows back to (see increment_recv_window()).
+void kernel_drops(int path, uint32_t count){
+    subflow* sf = &subflows[path];
+    if (count <= sf->rxq_drops){ return; }
+    uint32_t dropped = count - sf->rxq_drops;
+    sf->rxq_drops = count;
+    stats.kernel_drops += dropped;
+
+    our_max_receiving_window = MAX(our_max_receiving_window / 2, MIN_WINDOW);
+    drop_ceiling = our_max_receiving_window;
+    drop_clean_bytes = 0;
+    if (sf->rcvbuf > 0 && sf->rcvbuf < SOCKBUF_MAX){
+        sf->rcvbuf = grow_socket_buffer(sf->sockfd, SO_RCVBUF, SO_RCVBUFFORCE, MIN(2 * sf->rcvbuf, SOCKBUF_MAX));
+    }
+    pure_ack = true;
+    fprintf(stderr, "[DEBUG] Kernel dropped %u datagrams on subflow %d: window %d, receive buffer %d bytes.\n",
+            dropped, path, our_max_receiving_window, sf->rcvbuf);
+}
+
+// Check a received packet's checksum. Packets without one are only accepted
+// while checksums are not in use.
+bool verify_packet(packet* pkt, int bytes_recvd){
+    if (!(pkt->flags & CSUM)){ return !csum_enabled; }
+
+    size_t pkt_len = sizeof(packet) + ntohs(pkt->length);
+    if (pkt_len > (size_t) bytes_recvd){ return false; }
+
+    uint32_t their_csum = ntohl(pkt->csum);
+    pkt->csum = 0;
+    uint32_t our_csum = crc32c(0, pkt, pkt_len);
+    pkt->csum = htonl(their_csum);
+    return our_csum == their_csum;
+}
+
+// Timer callbacks: flag the expiry for the listen loop
+void syn_expired(void* arg){
+    (void) arg;
+    syn_due = true;
+}
+
+void linger_expired(void* arg){
+    (void) arg;
+    linger_done = true;
+}
+
+void probe_expired(void* arg){
+    (void) arg;
+    probe_due = true;
+}
+
+void fwd_expired(void* arg){
+    (void) arg;
+    // Give up on the peer after as long as MAX_RETRIES full timeouts
+    if (++fwd_retries > MAX_RETRIES * (RTO / fwd_max_interval())){
+        peer_gone = true;
+        return;
+    }
+    fwd_due = true;
+}
+
+void rack_expired(void* arg){
+    (void) arg;
+    rack_detect_loss();
+}
+
+void idle_timeout(void* arg){
+    (void) arg;
+    idle_expired = true;
+}
+
+// Single-stream adapters: everything travels on stream 0
+ssize_t input_single_stream(uint16_t stream, uint8_t* buf, size_t max_length){
+    return stream == 0 ? input(buf, max_length) : 0;
+}
+
+void output_single_stream(uint16_t stream, uint8_t* buf, size_t length){
+    (void) stream;
+    output(buf, length);
+}
+
+// Main function of transport layer; returns once the connection is closed
+// (both FINs ACKed, after the linger if ours went first), the peer stops
+// answering, or it stays idle for IDLE_TIMEOUT
 void listen_loop(int sockfd, struct sockaddr_in* addr, int initial_state,
                  ssize_t (*input_p)(uint8_t*, size_t),
                  void (*output_p)(uint8_t*, size_t)) {
+
+    // Set input and output function pointers
+    input = input_p;
+    output = output_p;
+
+    listen_loop_streams(sockfd, addr, initial_state, 1,
+                        input_single_stream, output_single_stream);
+}
+
+// Ask for (SYN) or accept (SYN-ACK) CRC32C checksums in the handshake
+void set_checksum(bool enabled){
+    csum_wanted = enabled;
+}
+
+void add_subflow(int sockfd, const struct sockaddr_in* addr){
+    if (num_subflows == MAX_SUBFLOWS){
+        fprintf(stderr, "[ERROR] At most %d subflows per connection.\n", MAX_SUBFLOWS);
+        exit(1);
+    }
+    subflow* sf = &subflows[num_subflows++];
+    sf->sockfd = sockfd;
+    sf->bound = addr != NULL;
+    if (addr != NULL){ sf->addr = *addr; }
+}
+
+void set_io(const transport_io* new_io){
+    io = new_io != NULL ? new_io : &udp_io;
+    set_clock(io->now_ns);
+}
+
+void set_fast_open(bool enabled){
+    fastopen_wanted = enabled;
+}
+
+void set_message_mode(int lifetime_ms, int max_retransmits){
+    msg_mode = true;
+    msg_lifetime = MAX(lifetime_ms, 0) * 1000;
+    msg_max_retransmits = max_retransmits;
+}
+
+void set_shared_memory(bool enabled){
+    shm_wanted = enabled;
+}
+
+void set_compression(bool enabled){
+    comp_wanted = enabled;
+}
+
+void set_fec(int mode){
+    fec_mode = mode < 0 ? FEC_ADAPTIVE : MIN(mode, FEC_MAX_BLOCK);
+    if (fec_mode > 0 && fec_mode < FEC_MIN_BLOCK){ fec_mode = FEC_MIN_BLOCK; }
+}
+
+void print_stats(){
+    fprintf(stderr, "[INFO] Sent %u data packets, %u retransmissions, %u parity packets; "
+            "rebuilt %u packets from parity; dropped %u packets with a bad checksum.\n",
+            stats.data_sent, stats.retransmits, stats.fec_sent, stats.fec_recovered,
+            stats.csum_errors);
+    if (stats.kernel_drops > 0){
+        fprintf(stderr, "[INFO] The kernel dropped %u datagrams on full receive queues.\n", stats.kernel_drops);
+    }
+    if (stats.msgs_abandoned > 0 || stats.msgs_skipped > 0){
+        fprintf(stderr, "[INFO] Gave up on %u messages; skipped %u messages the peer gave up on.\n",
+                stats.msgs_abandoned, stats.msgs_skipped);
+    }
+    if (srtt_ns > 0){
+        fprintf(stderr, "[INFO] Smoothed RTT %.3f ms, lowest RTT %.3f ms.\n",
+                srtt_ns / 1e6, min_rtt_ns / 1e6);
+    }
+    for (int i = 0; num_subflows > 1 && i < num_subflows; i++){
+        subflow* sf = &subflows[i];
+        fprintf(stderr, "[INFO] Subflow %d: %u packets sent, smoothed RTT %.3f ms, window %.1f packets%s.\n",
+                i, sf->packets_sent, sf->srtt_ns / 1e6, sf->cwnd, sf->active ? "" : " (not in use)");
+    }
+    if (shm_on){
+        fprintf(stderr, "[INFO] Shared memory: sent %lu bytes, received %lu bytes.\n",
+                shm.bytes_sent, shm.bytes_received);
+    }
+    if (comp_enabled){ print_compression_stats(); }
+}
+
+// Multi-stream variant of listen_loop; returns at the same points, or once
+// both ends ended their direction of a shared-memory channel
+void listen_loop_streams(int sockfd, struct sockaddr_in* addr, int initial_state,
+                         int n_streams,
+                         ssize_t (*input_p)(uint16_t, uint8_t*, size_t),
+                         void (*output_p)(uint16_t, uint8_t*, size_t)) {
     
     // fprintf(stderr, "[DEBUG] Enter listen loop...\n");
 
     // Set initial state (whether client or server)
     state = initial_state;
 
-    // Set input and output function pointers
-    input = input_p;
-    output = output_p;
-
-    // Set socket for nonblocking
-    int flags = fcntl(sockfd, F_GETFL);
-    flags |= O_NONBLOCK;
-    fcntl(sockfd, F_SETFL, flags);
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int));
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &(int) {1}, sizeof(int));
+    // Set stream count and stream input/output function pointers. The
+    // handshake settles on the smaller count the two ends asked for; until
+    // then (data in a fast open SYN) only stream 0 is certain to exist.
+    streams_wanted = MAX(1, MIN(n_streams, MAX_STREAMS));
+    num_streams = 1;
+    input_stream = input_p;
+    output_stream = output_p;
+    if (msg_mode && comp_wanted){
+        fprintf(stderr, "[INFO] No compression in message mode: it would merge messages.\n");
+        comp_wanted = false;
+    }
+    if (comp_wanted){ init_compression(input_stream, output_stream); }
+
+    // Path 0 is the socket and address we were given; add_subflow() added the others
+    subflows[0].sockfd = sockfd;
+    subflows[0].addr = *addr;
+    subflows[0].bound = true;
+    int sockfds[MAX_SUBFLOWS];
+    for (int i = 0; i < num_subflows; i++){
+        // Set socket for nonblocking
+        int flags = fcntl(subflows[i].sockfd, F_GETFL);
+        flags |= O_NONBLOCK;
+        fcntl(subflows[i].sockfd, F_SETFL, flags);
+        setsockopt(subflows[i].sockfd, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int));
+        setsockopt(subflows[i].sockfd, SOL_SOCKET, SO_REUSEPORT, &(int) {1}, sizeof(int));
+        size_socket_buffers(&subflows[i]);
+        sockfds[i] = subflows[i].sockfd;
+
+        timer_init(&subflows[i].pace, NULL, NULL);
+        subflows[i].active = i == 0;
+        subflows[i].min_rtt_ns = UINT64_MAX;
+        subflows[i].cwnd = SUBFLOW_INIT_CWND;
+    }
 
-    struct timeval last_activity;
-    struct timeval start;
-    gettimeofday(&last_activity, NULL);
-    gettimeofday(&start, NULL);
+    // Every deadline lives in the timer wheel; the loop sleeps until the socket
+    // is readable or the earliest timer is due
+    wheel_init(&wheel, TIMER_TICK);
+    timer_init(&syn_timer, syn_expired, NULL);
+    timer_init(&linger_timer, linger_expired, NULL);
+    timer_init(&idle_timer, idle_timeout, NULL);
+    timer_init(&join_timer, send_joins, NULL);
+    timer_init(&rack_timer, rack_expired, NULL);
+    timer_init(&tlp_timer, tlp_expired, NULL);
+    timer_init(&probe_timer, probe_expired, NULL);
+    timer_init(&fwd_timer, fwd_expired, NULL);
+    timer_set(&wheel, &idle_timer, IDLE_TIMEOUT);
 
     // Set initial sequence number
     // uint32_t r;
@@ -528,27 +2114,55 @@ void listen_loop(int sockfd, struct sockaddr_in* addr, int initial_state,
     else if (state == SERVER_AWAIT){
         seq = 500;
     }
+    our_isn = seq;
+    peer_addr = &subflows[0].addr;
 
     // Create buffer for incoming data
-    char buffer[sizeof(packet) + MAX_PAYLOAD] = {0};
+    char buffer[MAX_PACKET] = {0};
     packet* pkt = (packet*) &buffer;
-    socklen_t addr_size = sizeof(struct sockaddr_in);
+    int rx_next = 0; // Path read first in the next round
 
     // Start listen loop
     while (true) {
-        
-        memset(buffer, 0, sizeof(packet) + MAX_PAYLOAD);
 
-        // 1. Receive data from socket
-        int bytes_recvd = recvfrom(sockfd, &buffer, sizeof(buffer), 0, (struct sockaddr*) addr, &addr_size);
+        // A same-host peer took the shared-memory channel: it replaces UDP from here
+        if (shm_on){
+            shm_loop();
+            break;
+        }
+        
+        memset(buffer, 0, MAX_PACKET);
+        bool progress = false;  // sent or received something this round
+
+        // 1. Receive data from socket. Paths take turns, starting after the one
+        //    that delivered last, so a busy path cannot starve the others
+        int bytes_recvd = -1;
+        int path = rx_next;
+        struct sockaddr_in from;
+        for (int i = 0; i < num_subflows; i++){
+            path = (rx_next + i) % num_subflows;
+            bytes_recvd = io->recv(subflows[path].sockfd, &buffer, sizeof(buffer), &from);
+            if (bytes_recvd >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){ break; }
+        }
+        rx_next = (path + 1) % num_subflows;
+        if (bytes_recvd >= 0){ kernel_drops(path, rxq_drops_seen); }
         // fprintf(stderr, "[DEBUG] Bytes received: %d\n", bytes_recvd);
 
-        if (bytes_recvd > 0) {
+        if (bytes_recvd > 0 && ((size_t) bytes_recvd < sizeof(packet) || !verify_packet(pkt, bytes_recvd))) {
+            fprintf(stderr, "[DEBUG] Dropping corrupted packet (%d bytes).\n", bytes_recvd);
+            stats.csum_errors++;
+        }
+        else if (bytes_recvd > 0 && !subflow_heard(path, pkt, &from)) {
+            fprintf(stderr, "[DEBUG] Dropping a packet on subflow %d from outside the connection.\n", path);
+        }
+        else if (bytes_recvd > 0) {
             // fprintf(stderr, "[DEBUG] Receiving data from recvfrom()\n");
             print_diag(pkt, RECV);
             fprintf(stderr, "\n");
             recv_data(pkt);
-            gettimeofday(&last_activity, NULL);
+            timer_set(&wheel, &idle_timer, IDLE_TIMEOUT);
+            progress = true;
+            if (shm_on){ continue; } // the client took our channel: no more data over UDP
         }
         // No message received from the server yet; continue listening
         else if (bytes_recvd == -1 && errno != EAGAIN && errno != EWOULDBLOCK){ 
@@ -560,57 +2174,22 @@ void listen_loop(int sockfd, struct sockaddr_in* addr, int initial_state,
         packet* tosend = get_data();
         // a. Send packet with payload when data is available at STDIN
         if (tosend != NULL) {
-            ssize_t sent_bytes = sendto(sockfd, tosend, sizeof(packet) + ntohs(tosend->length), 0, (struct sockaddr*) addr, sizeof(struct sockaddr_in));
-
-            if (sent_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
-                perror("[ERROR] sendto() failed to send data to socket.\n");
-                exit(1);
-            }
+            send_on_subflow(tx_subflow, tosend);
             free(tosend);
-            gettimeofday(&last_activity, NULL);
+            // Data packets have no room for SACK blocks: report holes in a pure ACK too
+            if (pure_ack && recv_buf_has_holes()){
+                send_pure_ack(ack_subflow());
+            }
+            timer_set(&wheel, &idle_timer, IDLE_TIMEOUT);
+            progress = true;
         }
         // b. Send pure ACK packet when no data is available at STDIN
         else if (pure_ack && !drop_packet) {
-            packet* pure_ack_pkt = generate_pure_ack_packet();
-            ssize_t sent_bytes = sendto(sockfd, pure_ack_pkt, sizeof(packet), 0, (struct sockaddr*) addr, sizeof(struct sockaddr_in));
-            if (sent_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
-                perror("[ERROR] sendto() failed to send data to socket.\n");
-                exit(1);
-            }
-            free(pure_ack_pkt);
-            pure_ack = false;
-            gettimeofday(&last_activity, NULL);
-        }
-        // c. Retransmit remaining packets in send_buf (packets sent out but haven't received ACK from the other end)
-        else if (send_buf != NULL){
-            gettimeofday(&now, NULL);
-            if (TV_DIFF(now, last_activity) > 1000000){  // Ensures that we only retransmit after 1 sec of inactivity
-                // Retransmit the first packet in send_buf
-                packet* original_pkt = &send_buf->pkt;
-
-                // Make a deep copy of original packet
-                int payload_len = ntohs(original_pkt->length);
-                packet* pkt = calloc(1, sizeof(packet) + payload_len);
-                memcpy(pkt, original_pkt, sizeof(packet) + payload_len);
-
-                // Modify ACK before sending
-                pkt->ack = htons(ack);
-                pkt->win = htons(our_max_receiving_window-our_recv_window);  
-
-                ssize_t sent_bytes = sendto(sockfd, pkt, sizeof(packet) + ntohs(pkt->length), 0, (struct sockaddr*) addr, sizeof(struct sockaddr_in));
-                if (sent_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
-                    perror("[ERROR] sendto() failed to send data to socket.\n");
-                    exit(1);
-                }
-
-                fprintf(stderr, "\nRETRANSMIT packet # %hu to clear up send buffer\n", ntohs(pkt->seq));
-                print_diag(pkt, SEND);
-                fprintf(stderr, "\n");
-
-                free(pkt);
-                gettimeofday(&last_activity, NULL);
-            }
+            send_pure_ack(ack_subflow());
+            timer_set(&wheel, &idle_timer, IDLE_TIMEOUT);
+            progress = true;
         }
+        // c. Segments in send_buf are retransmitted by their own timers (segment_timeout)
         // d. Linear scan recv_buf and write out acked packets
         else if (recv_buf != NULL){
             output_recv_buffer();
@@ -618,14 +2197,39 @@ void listen_loop(int sockfd, struct sockaddr_in* addr, int initial_state,
         // e. When there's neither input from the socket nor any outgoing packet to send,
         //    we wait for 4 seconds of inactivity before closing the connection,  
         //    to allow time for potential retransmissions or delayed packets to arrive.
-        else {
-            gettimeofday(&now, NULL);
-            if (TV_DIFF(now, last_activity) > 4000000) {  // 4 seconds
-                fprintf(stderr, "[INFO] Idle timeout reached. Exiting.\n");
-                break;
-            }
+        //    This only happens when the peer vanished before closing properly.
+        else if (idle_expired && send_buf == NULL) {
+            fprintf(stderr, "[INFO] Idle timeout reached. Exiting.\n");
+            break;
+        }
+        if (idle_expired){  // still busy: wait another period
+            idle_expired = false;
+            timer_set(&wheel, &idle_timer, IDLE_TIMEOUT);
         }
 
-        usleep(10000);
+        // f. Close once both sides sent a FIN and all data is ACKed. If only our FIN
+        //    is unACKed after the peer closed, our ACK of their FIN arrived (they
+        //    would resend it otherwise) and their ACK of ours keeps getting lost.
+        if (connection_closed()){
+            fprintf(stderr, "[INFO] Connection closed. Exiting.\n");
+            break;
+        }
+        if (peer_closed() && fin_retries > FIN_RETRIES){
+            fprintf(stderr, "[INFO] FIN not ACKed after the peer closed. Exiting.\n");
+            break;
+        }
+        if (peer_gone){
+            fprintf(stderr, "[ERROR] Packet not ACKed after %d retransmissions. Exiting.\n", MAX_RETRIES);
+            break;
+        }
+
+        // g. Run expired timers. After a round with no traffic, sleep until a packet
+        //    arrives or the next timer is due (instead of polling every 10 ms)
+        bool fired = wheel_run(&wheel) > 0;
+        if (!progress && !fired){
+            io->wait(sockfds, num_subflows, wheel_next_ns(&wheel));
+            wheel_run(&wheel);
+        }
     }
+    print_stats();
 }
\ No newline at end of file
@@ -1,9 +1,80 @@
 #pragma once
 
+#include <netinet/in.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
-// Main function of transport layer; never quits
+// Clock and datagrams the transport runs on. By default these are
+// CLOCK_MONOTONIC and the UDP socket passed to listen_loop; a simulator
+// supplies its own to run connections on virtual time over a fake network.
+typedef struct {
+    uint64_t (*now_ns)(void); // NULL: CLOCK_MONOTONIC
+    ssize_t (*send)(int sockfd, const void* buf, size_t len, const struct sockaddr_in* addr);
+    // Returns -1 with errno EAGAIN when nothing has arrived
+    ssize_t (*recv)(int sockfd, void* buf, size_t len, struct sockaddr_in* addr);
+    // Block until a datagram arrives on one of the n sockets or now_ns()
+    // reaches deadline_ns (UINT64_MAX: no deadline)
+    void (*wait)(const int* sockfds, int n, uint64_t deadline_ns);
+} transport_io;
+
+// Main function of transport layer. Returns once the connection is closed:
+// both ends sent a FIN and it was ACKed (after a short linger if our FIN went
+// first), our FIN went unACKed FIN_RETRIES times after the peer closed, a
+// segment went unACKed MAX_RETRIES times, or nothing arrived for IDLE_TIMEOUT
 void listen_loop(int sockfd, struct sockaddr_in* addr, int type,
                  ssize_t (*input_p)(uint8_t*, size_t),
                  void (*output_p)(uint8_t*, size_t));
+
+// Same as listen_loop, but multiplexes n_streams independently ordered streams
+// over the connection. input_p is asked for data on a given stream; output_p
+// receives each stream's data in order, unaffected by loss on other streams.
+// Returns as listen_loop does, or when a shared-memory channel is finished.
+void listen_loop_streams(int sockfd, struct sockaddr_in* addr, int type,
+                         int n_streams,
+                         ssize_t (*input_p)(uint16_t, uint8_t*, size_t),
+                         void (*output_p)(uint16_t, uint8_t*, size_t));
+
+// Forward error correction for data we send: 0 turns it off, k > 0 sends one
+// XOR parity packet per k data packets, a negative value adapts k to the
+// measured loss rate. Receivers always repair from parity packets they get.
+void set_fec(int mode);
+
+// End-to-end CRC32C over header and payload (on by default). Used only when
+// both ends ask for it in the handshake; packets failing it are dropped.
+void set_checksum(bool enabled);
+
+// Stream compression (off by default). Used only when both ends ask for it in
+// the handshake: data is deflated before segmentation and inflated after
+// in-order delivery, and incompressible blocks are sent as they are.
+void set_compression(bool enabled);
+
+// Message mode (off by default): every chunk input_p returns is one message,
+// sent in a packet of its own. With the peer's agreement, a message not ACKed
+// within lifetime_ms, or lost again after max_retransmits retransmissions, is
+// given up on and the peer delivers what follows it without waiting. 0 means
+// no deadline; a negative max_retransmits means no limit.
+void set_message_mode(int lifetime_ms, int max_retransmits);
+
+// TCP Fast Open style 0-RTT (off by default). A client sends its first data
+// in the SYN, authorized by a cookie the server issued on an earlier
+// connection; a server accepts such data once it checks the cookie.
+void set_fast_open(bool enabled);
+
+// Shared memory with a same-host peer (on by default). A client talking to
+// 127.0.0.0/8 offers it in the SYN; the server then sends it a memfd with one
+// lock-free ring per direction over a unix socket, and the connection's
+// streams go through the rings instead of UDP. Used only when both ends agree.
+void set_shared_memory(bool enabled);
+
+// Multipath (one path by default): also stripe the next connection over
+// sockfd, sending to addr. A server passes NULL and learns the address from
+// the client's first packet on that socket. The handshake settles on the
+// smaller number of paths the two ends offer; each path then carries new data
+// at its own pace, and the receiver puts everything back in order.
+void add_subflow(int sockfd, const struct sockaddr_in* addr);
+
+// Run this thread's connections on another network (NULL restores the UDP
+// socket). The clock is shared by every thread. Connection state is per
+// thread, so one process can run several connections, one per thread.
+void set_io(const transport_io* io);
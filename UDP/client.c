@@ -6,17 +6,76 @@
 #include <sys/socket.h> // socket interface
 #include <unistd.h>     // close, usleep
 #include <errno.h>
+#include "ping.h"
+#include "traffic.h"
+#include "wait.h"
+
+void usage(){
+    fprintf(stderr, "Usage: client [-w <block|spin|busy>] [-a <cpu>] [-p [-c <count>] [-i <rate>] [-s <size>]]\n"
+                    "              [-g [-t <threads>] [-i <rate> | -b <Mbit/s>] [-s <size>] [-d <seconds>]] <hostname> <port> \n");
+    exit(1);
+}
 
 int main(int argc, char** argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: client <hostname> <port> \n");
-        exit(1);
+    int ping = 0;         // send latency probes instead of echoing stdin
+    int generate = 0;     // send generated traffic instead of echoing stdin
+    int count = 1000;     // probes to send
+    double rate = -1;     // packets per second (default: 100 probes, unlimited traffic)
+    double mbits = 0;     // generator bandwidth instead of a packet rate
+    int size = 64;        // datagram size in bytes
+    int n_threads = 1;    // generator threads
+    int duration = 10;    // generator run time in seconds
+    int cpu = -1;         // CPU to pin to
+    int opt;
+    while ((opt = getopt(argc, argv, "pc:i:s:w:a:gt:b:d:")) != -1) {
+        switch (opt) {
+        case 'w': // how to wait for the socket and STDIN
+            if (set_wait_mode(optarg) < 0){ usage(); }
+            break;
+        case 'a':
+            cpu = atoi(optarg);
+            break;
+        case 'p':
+            ping = 1;
+            break;
+        case 'g':
+            generate = 1;
+            break;
+        case 't':
+            n_threads = atoi(optarg);
+            if (n_threads < 1 || n_threads > MAX_FLOWS){ usage(); }
+            break;
+        case 'b':
+            mbits = atof(optarg);
+            if (mbits <= 0){ usage(); }
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            if (duration < 1){ usage(); }
+            break;
+        case 'c':
+            count = atoi(optarg);
+            if (count < 1){ usage(); }
+            break;
+        case 'i':
+            rate = atof(optarg);
+            if (rate <= 0){ usage(); }
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind < 2) {
+        usage();
     }
 
     // Only supports localhost as a hostname
     const char* addr =
-        strcmp(argv[1], "localhost") == 0 ? "127.0.0.1" : argv[1];  // if argv[1] == "localhost", use "127.0.0.1"; else, use argv[1]
-    int port = atoi(argv[2]);  // string to int
+        strcmp(argv[optind], "localhost") == 0 ? "127.0.0.1" : argv[optind];  // if argv[1] == "localhost", use "127.0.0.1"; else, use argv[1]
+    int port = atoi(argv[optind + 1]);  // string to int
 
     // Create socket
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);  // use IPv4, use UDP
@@ -30,6 +89,8 @@ int main(int argc, char** argv) {
     int socket_flags = fcntl(sockfd, F_GETFL);
     socket_flags |= O_NONBLOCK;
     fcntl(sockfd, F_SETFL, socket_flags);
+    tune_socket(sockfd);
+    pin_cpu(cpu);
 
     // 2. Set stdin to be nonblocking
     int stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
@@ -43,12 +104,31 @@ int main(int argc, char** argv) {
     serveraddr.sin_port = htons(port);             // Little -> Big Endian (network order)
 
     socklen_t serversize = sizeof(serveraddr);     // struct size
+
+    if (generate){
+        if (mbits > 0){ rate = mbits * 1e6 / 8 / size; }
+        run_generator(&serveraddr, n_threads, rate < 0 ? 0 : rate, size, duration);
+        close(sockfd);
+        return 0;
+    }
+
+    if (ping){
+        run_ping(sockfd, &serveraddr, count, rate < 0 ? 100 : rate, size);
+        close(sockfd);
+        return 0;
+    }
+
     int BUFF_SIZE = 1024;
     char recv_buffer[BUFF_SIZE];  // buffer to store messages from the server
     char send_buffer[BUFF_SIZE];  // stores message to be sent to the server
 
+    // Wait on the socket and STDIN together instead of spinning on both
+    struct pollfd fds[2] = {{sockfd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+
     // Listen loop
     while(1){
+        if (wait_ready(fds, 2, -1) <= 0){ continue; }
+
         // A. Receive from socket and write to STDOUT
         struct sockaddr_in recv_addr;
         socklen_t recv_addrlen = sizeof(recv_addr);     
@@ -89,6 +169,7 @@ int main(int argc, char** argv) {
             exit(1);
         }
         else if(bytes_read == 0){
+            fds[1].fd = -1;  // EOF: stop waiting on STDIN, keep receiving echoes
             continue;
         }
 
@@ -0,0 +1,159 @@
+#include "ping.h"
+#include "wait.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Log-linear histogram of RTTs in ns: exact below 64 ns, then 32 buckets per
+// power of two (about 3% resolution) up to 2^40 ns
+#define SUB_BUCKETS 32
+#define MAX_EXP 40
+#define N_BUCKETS (2 * SUB_BUCKETS + (MAX_EXP - 6) * SUB_BUCKETS)
+#define WAIT_NS 1000000000ULL // How long to wait for echoes after the last probe
+#define MAX_PROBE_SIZE 9216
+
+static uint64_t hist[N_BUCKETS];
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t v){
+    if (v < 2 * SUB_BUCKETS){ return v; }
+    int e = 63 - __builtin_clzll(v);  // v in [2^e, 2^(e+1))
+    if (e >= MAX_EXP){ return N_BUCKETS - 1; }
+    int shift = e - 5;                // keeps 6 significant bits: 32..63
+    return 2 * SUB_BUCKETS + (e - 6) * SUB_BUCKETS + (int) (v >> shift) - SUB_BUCKETS;
+}
+
+// Middle of a bucket's value range
+static uint64_t value_of(int idx){
+    if (idx < 2 * SUB_BUCKETS){ return idx; }
+    int e = (idx - 2 * SUB_BUCKETS) / SUB_BUCKETS + 6;
+    uint64_t sub = (idx - 2 * SUB_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+    int shift = e - 5;
+    return (sub << shift) + (1ULL << shift) / 2;
+}
+
+// Value at percentile p, clamped to the exact extremes
+static uint64_t percentile(uint64_t total, double p, uint64_t min, uint64_t max){
+    uint64_t rank = (uint64_t) (p / 100.0 * total + 0.5);
+    if (rank < 1){ rank = 1; }
+    uint64_t seen = 0;
+    for (int i = 0; i < N_BUCKETS; i++){
+        seen += hist[i];
+        if (seen >= rank){
+            uint64_t v = value_of(i);
+            return v < min ? min : v > max ? max : v;
+        }
+    }
+    return max;
+}
+
+static void print_us(const char* label, uint64_t ns){
+    fprintf(stdout, " %s %.1f us", label, ns / 1000.0);
+}
+
+void run_ping(int sockfd, struct sockaddr_in* serveraddr, int count, double rate, int size){
+    if (size < (int) sizeof(probe)){ size = sizeof(probe); }
+    if (size > MAX_PROBE_SIZE){ size = MAX_PROBE_SIZE; }
+
+    char send_buffer[MAX_PROBE_SIZE] = {0};
+    char recv_buffer[MAX_PROBE_SIZE];
+    uint8_t* seen = calloc(count, 1);  // echoes received per probe
+    uint64_t interval = (uint64_t) (1e9 / rate);
+
+    uint64_t received = 0, duplicated = 0, reordered = 0;
+    uint64_t min_rtt = UINT64_MAX, max_rtt = 0, last_rtt = 0;
+    double jitter = 0;        // mean |difference| between consecutive RTTs
+    int64_t highest_seq = -1; // highest probe number echoed so far
+    int sent = 0;
+
+    uint64_t start = now_ns();
+    uint64_t next_send = start;
+    uint64_t deadline = 0;    // stop waiting for echoes at this time
+
+    while (sent < count || now_ns() < deadline){
+        // A. Send every probe that is due
+        uint64_t now = now_ns();
+        while (sent < count && now >= next_send){
+            probe* p = (probe*) send_buffer;
+            p->magic = PROBE_MAGIC;
+            p->seq = sent;
+            p->send_ns = now_ns();
+            if (sendto(sockfd, send_buffer, size, 0, (struct sockaddr*) serveraddr, sizeof(*serveraddr)) < 0
+                && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS){
+                fprintf(stderr, "[ERROR] sendto() failed to send probe.\n");
+                exit(1);
+            }
+            sent++;
+            next_send += interval;
+            if (sent == count){ deadline = now_ns() + WAIT_NS; }
+        }
+
+        // B. Wait for echoes until the next probe is due
+        uint64_t wake = sent < count ? next_send : deadline;
+        now = now_ns();
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        if (wait_ready(&pfd, 1, wake > now ? (int64_t) (wake - now) : 0) <= 0){ continue; }
+
+        // C. Match every echo that is queued
+        int bytes_recvd;
+        while ((bytes_recvd = recv(sockfd, recv_buffer, sizeof(recv_buffer), MSG_DONTWAIT)) > 0){
+            uint64_t arrival = now_ns();
+            probe* p = (probe*) recv_buffer;
+            if (bytes_recvd < (int) sizeof(probe) || p->magic != PROBE_MAGIC || p->seq >= (uint32_t) count){
+                continue;
+            }
+            if (seen[p->seq]++){
+                duplicated++;
+                continue;
+            }
+            if ((int64_t) p->seq < highest_seq){ reordered++; }
+            else{ highest_seq = p->seq; }
+
+            uint64_t rtt = arrival - p->send_ns;
+            hist[bucket_of(rtt)]++;
+            if (received > 0){
+                jitter += (rtt > last_rtt ? rtt - last_rtt : last_rtt - rtt);
+            }
+            last_rtt = rtt;
+            min_rtt = rtt < min_rtt ? rtt : min_rtt;
+            max_rtt = rtt > max_rtt ? rtt : max_rtt;
+            received++;
+            if (received == (uint64_t) count){ deadline = 0; } // all back: stop waiting
+        }
+    }
+
+    // Report
+    uint64_t lost = count - received;
+    fprintf(stdout, "--- %d probes to %s:%d, %d bytes, %.0f/s ---\n", count,
+            inet_ntoa(serveraddr->sin_addr), ntohs(serveraddr->sin_port), size, rate);
+    fprintf(stdout, "sent %d, received %lu, lost %lu (%.2f%%), duplicated %lu, reordered %lu\n",
+            sent, received, lost, 100.0 * lost / count, duplicated, reordered);
+    if (received > 0){
+        fprintf(stdout, "rtt");
+        print_us("min", min_rtt);
+        print_us("p50", percentile(received, 50, min_rtt, max_rtt));
+        print_us("p99", percentile(received, 99, min_rtt, max_rtt));
+        print_us("p99.9", percentile(received, 99.9, min_rtt, max_rtt));
+        print_us("max", max_rtt);
+        if (received > 1){ print_us("jitter", (uint64_t) (jitter / (received - 1))); }
+        fprintf(stdout, "\n");
+    }
+
+    // CPU time used while probing, as a share of one core: shows the cost of the wait mode
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_s = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+                   + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    fprintf(stdout, "cpu %.0f%% of one core\n", 100.0 * cpu_s / ((now_ns() - start) / 1e9));
+    free(seen);
+}
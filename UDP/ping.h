@@ -0,0 +1,17 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <stdint.h>
+
+// Latency probe: a reflector sends it back unchanged
+typedef struct {
+    uint32_t magic;   // PROBE_MAGIC, to ignore unrelated datagrams
+    uint32_t seq;     // Probe number, from 0
+    uint64_t send_ns; // CLOCK_MONOTONIC time the probe was sent
+} probe;
+
+#define PROBE_MAGIC 0x50524f42 // "PROB"
+
+// Send count probes of size bytes at rate probes/s to a reflector, match the
+// echoes and report round-trip time percentiles, loss and reordering
+void run_ping(int sockfd, struct sockaddr_in* serveraddr, int count, double rate, int size);
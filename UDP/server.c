@@ -1,6 +1,9 @@
+#define _GNU_SOURCE     // recvmmsg(), sendmmsg()
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -8,21 +11,174 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include "traffic.h"
+#include "wait.h"
 
-int main(int argc, char** argv) {
-    if (argc < 2) {
-        fprintf(stdout, "Usage: server <port>\n");
-        exit(1);
-    }
+#define BATCH 64          // Datagrams per recvmmsg()/sendmmsg() call
+#define MAX_DATAGRAM 9216 // Largest datagram reflected in full (jumbo frame)
+#define MAX_WORKERS 64
 
-    int port = atoi(argv[1]);  // string to int
+// Reflector worker: one SO_REUSEPORT socket, echoing every datagram to its sender
+typedef struct {
+    int sockfd;
+    int cpu;           // CPU to pin the thread to (-1: none)
+    uint64_t packets;  // Datagrams reflected (read by the main thread for stats)
+} worker;
 
-    // TODO: Create socket
+// Create a UDP socket bound to port; with reuseport, several sockets can share it
+int bind_socket(int port, int reuseport){
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);  // use IPv4, use UDP
     if (sockfd < 0){ 
         perror("socket");
         exit(1); 
     }
+    if (reuseport){
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &(int) {1}, sizeof(int));
+    }
+    tune_socket(sockfd);
+
+    struct sockaddr_in servaddr = {0};
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = INADDR_ANY;  // accept connections from any IP address
+    servaddr.sin_port = htons(port);        // Little -> Big Endian 
+
+    if (bind(sockfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) < 0){ 
+        fprintf(stderr, "[ERROR] Fail to bind address to socket.\n");
+        exit(1);
+    }
+    return sockfd;
+}
+
+// Receive a batch of datagrams and send each one straight back to where it came from
+void* reflect_loop(void* arg){
+    worker* w = arg;
+    struct mmsghdr msgs[BATCH];
+    struct iovec iovecs[BATCH];
+    struct sockaddr_in addrs[BATCH];
+    char* bufs = malloc(BATCH * MAX_DATAGRAM);
+    struct pollfd pfd = {w->sockfd, POLLIN, 0};
+    pin_cpu(w->cpu);
+
+    while (1){
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < BATCH; i++){
+            iovecs[i].iov_base = bufs + i * MAX_DATAGRAM;
+            iovecs[i].iov_len = MAX_DATAGRAM;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        // Spin until a datagram is queued unless blocking in recvmmsg() is wanted
+        if (wait_mode != WAIT_BLOCK && wait_ready(&pfd, 1, -1) <= 0){ continue; }
+
+        // Block for the first datagram, then take whatever else is queued
+        int n = recvmmsg(w->sockfd, msgs, BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0){
+            if (errno == EINTR){ continue; }
+            fprintf(stderr, "[ERROR] recvmmsg() failed to receive data.\n");
+            exit(1);
+        }
+
+        // Echo each datagram with its own length; the source address is already in msg_name
+        for (int i = 0; i < n; i++){
+            iovecs[i].iov_len = msgs[i].msg_len;
+        }
+        int sent = 0;
+        while (sent < n){
+            int did_send = sendmmsg(w->sockfd, msgs + sent, n - sent, 0);
+            if (did_send < 0){
+                if (errno == EINTR){ continue; }
+                break; // send buffer full (ENOBUFS/EAGAIN): drop the rest like the network would
+            }
+            sent += did_send;
+        }
+        __atomic_fetch_add(&w->packets, sent, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Reflector mode: n_workers threads, each with its own socket on the same port;
+// the kernel spreads peers across them by address hash
+void run_reflector(int port, int n_workers, int cpu){
+    worker workers[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+
+    for (int i = 0; i < n_workers; i++){
+        workers[i].sockfd = bind_socket(port, 1);
+        workers[i].packets = 0;
+        workers[i].cpu = cpu < 0 ? -1 : cpu + i;  // one CPU per worker
+        pthread_create(&threads[i], NULL, reflect_loop, &workers[i]);
+    }
+    fprintf(stderr, "[INFO] Reflecting datagrams on port %d with %d worker(s).\n", port, n_workers);
+
+    // Report the packet rate once per second while there is traffic
+    uint64_t last_total = 0;
+    while (1){
+        sleep(1);
+        uint64_t total = 0;
+        for (int i = 0; i < n_workers; i++){
+            total += __atomic_load_n(&workers[i].packets, __ATOMIC_RELAXED);
+        }
+        if (total != last_total){
+            fprintf(stderr, "[INFO] %lu packets/s reflected\n", total - last_total);
+        }
+        last_total = total;
+    }
+}
+
+void usage(){
+    fprintf(stdout, "Usage: server [-w <block|spin|busy>] [-a <cpu>] [-r [-t <threads>] | -k] <port>\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    // Parse options
+    int reflector = 0;
+    int sink = 0;
+    int n_workers = 1;
+    int cpu = -1;  // first CPU to pin to
+    int opt;
+    while ((opt = getopt(argc, argv, "rt:w:a:k")) != -1) {
+        switch (opt) {
+        case 'w': // how to wait for the socket and STDIN
+            if (set_wait_mode(optarg) < 0){ usage(); }
+            break;
+        case 'a':
+            cpu = atoi(optarg);
+            break;
+        case 'r': // reflect each datagram back to its sender
+            reflector = 1;
+            break;
+        case 'k': // count generated traffic
+            sink = 1;
+            break;
+        case 't': // reflector worker threads
+            n_workers = atoi(optarg);
+            if (n_workers < 1 || n_workers > MAX_WORKERS){ usage(); }
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind < 1) {
+        usage();
+    }
+
+    int port = atoi(argv[optind]);  // string to int
+
+    if (reflector){
+        run_reflector(port, n_workers, cpu);
+    }
+
+    // Create socket and bind address to it
+    int sockfd = bind_socket(port, 0);
+    pin_cpu(cpu);
+
+    if (sink){
+        run_sink(sockfd);
+    }
 
     // Set stdin and socket nonblocking
     // 1. Set socket to be nonblocking
@@ -34,20 +190,6 @@ int main(int argc, char** argv) {
     int stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
     stdin_flags |= O_NONBLOCK;
     fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
-
-
-    // Construct server address (to accept connection)
-    struct sockaddr_in servaddr;
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = INADDR_ANY;  // accept connections from any IP address
-    servaddr.sin_port = htons(port);        // Little -> Big Endian 
-
-    // Bind address to socket
-    int did_bind = bind(sockfd, (struct sockaddr*) &servaddr, sizeof(servaddr));
-    if (did_bind < 0){ 
-        fprintf(stderr, "[ERROR] Fail to bind address to socket.\n");
-        exit(1);
-    }
     
     // Create address struct to store client address
     struct sockaddr_in clientaddr = {0};        // zeros out every field in the struct  
@@ -58,8 +200,15 @@ int main(int argc, char** argv) {
     char send_buffer[BUFF_SIZE];  // stores message to be sent to the client
     int client_connected = 0;
 
+    // Wait on the socket, and on STDIN once the client is known, instead of spinning
+    struct pollfd fds[2] = {{sockfd, POLLIN, 0}, {-1, POLLIN, 0}};
+    int stdin_done = 0;
+
     // Listen loop
     while (1){  
+        fds[1].fd = client_connected && !stdin_done ? STDIN_FILENO : -1;
+        if (wait_ready(fds, 2, -1) <= 0){ continue; }
+
         // A. Received from socket and write to STDOUT
         int bytes_recvd = recvfrom(sockfd, recv_buffer, BUFF_SIZE, 0, (struct sockaddr*) &clientaddr, &clientsize); 
 
@@ -99,6 +248,7 @@ int main(int argc, char** argv) {
                 exit(1);
             }
             else if(bytes_read == 0){
+                stdin_done = 1;  // EOF: stop waiting on STDIN, keep receiving
                 continue;
             }
         }
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
+#include "traffic.h"
+#include "wait.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BATCH 64             // Datagrams per sendmmsg()/recvmmsg() call
+#define MAX_DATAGRAM 9216
+#define SPIN_NS 50000        // Sleep between batches only if the next one is due later than this
+#define SEQ_WINDOW 65536     // Sequence numbers the sink remembers per flow for duplicate detection
+#define SINK_RCVBUF (8 << 20)
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ---------------- Generator ----------------
+
+typedef struct {
+    int sockfd;
+    uint32_t run;
+    uint32_t flow;
+    double rate;       // packets/s for this thread (0: unlimited)
+    int size;
+    uint64_t sent;     // read by the main thread for stats
+} sender;
+
+static volatile int stop_sending = 0;
+
+static void* send_loop(void* arg){
+    sender* s = arg;
+    struct mmsghdr msgs[BATCH];
+    struct iovec iovecs[BATCH];
+    char* bufs = calloc(BATCH, s->size);
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH; i++){
+        traffic_header* hdr = (traffic_header*) (bufs + i * s->size);
+        hdr->magic = TRAFFIC_MAGIC;
+        hdr->run = s->run;
+        hdr->flow = s->flow;
+        iovecs[i].iov_base = hdr;
+        iovecs[i].iov_len = s->size;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;  // socket is connected: no msg_name
+    }
+
+    uint64_t seq = 0;
+    uint64_t start = now_ns();
+    while (!stop_sending){
+        // Packets due by now on the rate schedule; unlimited sends full batches
+        int n = BATCH;
+        if (s->rate > 0){
+            uint64_t due = (uint64_t) ((now_ns() - start) * s->rate / 1e9) + 1;
+            if (due <= seq){
+                // Sleep if the next packet is far off, otherwise spin for precision
+                uint64_t next = start + (uint64_t) (seq * 1e9 / s->rate);
+                uint64_t now = now_ns();
+                if (next > now + SPIN_NS){
+                    uint64_t gap = next - now - SPIN_NS; // can exceed a second at low rates
+                    struct timespec ts = {(time_t) (gap / 1000000000), (long) (gap % 1000000000)};
+                    nanosleep(&ts, NULL);
+                }
+                continue;
+            }
+            n = due - seq < BATCH ? due - seq : BATCH;
+        }
+
+        for (int i = 0; i < n; i++){
+            ((traffic_header*) iovecs[i].iov_base)->seq = seq + i;
+        }
+        int did_send = sendmmsg(s->sockfd, msgs, n, 0);
+        if (did_send < 0){
+            if (errno == EINTR || errno == EAGAIN || errno == ENOBUFS || errno == ECONNREFUSED){ continue; }
+            fprintf(stderr, "[ERROR] sendmmsg() failed to send data.\n");
+            exit(1);
+        }
+        seq += did_send;
+        __atomic_store_n(&s->sent, seq, __ATOMIC_RELAXED);
+    }
+    free(bufs);
+    return NULL;
+}
+
+void run_generator(struct sockaddr_in* serveraddr, int n_threads, double rate, int size, int duration){
+    sender senders[MAX_FLOWS];
+    pthread_t threads[MAX_FLOWS];
+    if (size < (int) sizeof(traffic_header)){ size = sizeof(traffic_header); }
+    if (size > MAX_DATAGRAM){ size = MAX_DATAGRAM; }
+
+    srand(time(NULL) ^ getpid());
+    uint32_t run = rand();
+    for (int i = 0; i < n_threads; i++){
+        // Each thread gets its own connected socket, so sends skip the route lookup
+        int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd < 0 || connect(sockfd, (struct sockaddr*) serveraddr, sizeof(*serveraddr)) < 0){
+            fprintf(stderr, "[ERROR] Fail to create socket.\n");
+            exit(1);
+        }
+        tune_socket(sockfd);
+        senders[i] = (sender) {sockfd, run, i, rate / n_threads, size, 0};
+        pthread_create(&threads[i], NULL, send_loop, &senders[i]);
+    }
+    fprintf(stderr, "[INFO] Generating %d-byte datagrams to %s:%d from %d thread(s) for %d s.\n", size,
+            inet_ntoa(serveraddr->sin_addr), ntohs(serveraddr->sin_port), n_threads, duration);
+
+    // Report the send rate once per second
+    uint64_t last_total = 0, total = 0;
+    for (int t = 0; t < duration; t++){
+        sleep(1);
+        total = 0;
+        for (int i = 0; i < n_threads; i++){
+            total += __atomic_load_n(&senders[i].sent, __ATOMIC_RELAXED);
+        }
+        fprintf(stderr, "[INFO] %lu packets/s sent (%.1f Mbit/s)\n", total - last_total,
+                (total - last_total) * size * 8 / 1e6);
+        last_total = total;
+    }
+    stop_sending = 1;
+
+    total = 0;
+    for (int i = 0; i < n_threads; i++){
+        pthread_join(threads[i], NULL);
+        total += senders[i].sent;
+        close(senders[i].sockfd);
+    }
+    fprintf(stdout, "sent %lu packets in %d s (%.0f packets/s)\n", total, duration, (double) total / duration);
+}
+
+// ---------------- Sink ----------------
+
+// What the sink knows about one generator thread
+typedef struct {
+    uint32_t run;
+    uint32_t flow;
+    int active;
+    uint64_t highest;               // highest seq seen
+    uint8_t seen[SEQ_WINDOW / 8];   // bit per seq in (highest - SEQ_WINDOW, highest]
+} flow_state;
+
+// Totals since start, read by the main thread for the per-second report
+typedef struct {
+    uint64_t received;
+    uint64_t expected;    // sum over flows of highest seq + 1
+    uint64_t unique;      // distinct packets received
+    uint64_t duplicated;
+    uint64_t reordered;   // arrived after a higher seq of the same flow
+    uint64_t bytes;
+} sink_stats;
+
+static flow_state flows[MAX_FLOWS];
+static sink_stats sink;
+
+#define BIT(seq) (flow->seen[((seq) % SEQ_WINDOW) / 8] & (1 << ((seq) % 8)))
+#define SET_BIT(seq) (flow->seen[((seq) % SEQ_WINDOW) / 8] |= (1 << ((seq) % 8)))
+
+static void count_packet(traffic_header* hdr){
+    flow_state* flow = &flows[hdr->flow % MAX_FLOWS];
+    uint64_t seq = hdr->seq;
+
+    // First packet of this flow (or of a new generator run): start over
+    if (!flow->active || flow->run != hdr->run || flow->flow != hdr->flow){
+        memset(flow, 0, sizeof(*flow));
+        flow->active = 1;
+        flow->run = hdr->run;
+        flow->flow = hdr->flow;
+        flow->highest = seq;
+        SET_BIT(seq);
+        __atomic_fetch_add(&sink.expected, seq + 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sink.unique, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (seq > flow->highest){
+        // Forget the sequence numbers that slide out of the window
+        if (seq - flow->highest >= SEQ_WINDOW){ memset(flow->seen, 0, sizeof(flow->seen)); }
+        else{
+            for (uint64_t s = flow->highest + 1; s <= seq; s++){
+                flow->seen[(s % SEQ_WINDOW) / 8] &= ~(1 << (s % 8));
+            }
+        }
+        SET_BIT(seq);
+        __atomic_fetch_add(&sink.expected, seq - flow->highest, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sink.unique, 1, __ATOMIC_RELAXED);
+        flow->highest = seq;
+    }
+    else if (flow->highest - seq >= SEQ_WINDOW){
+        // Too old to tell apart from a duplicate: count it as a late arrival
+        __atomic_fetch_add(&sink.reordered, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sink.unique, 1, __ATOMIC_RELAXED);
+    }
+    else if (BIT(seq)){
+        __atomic_fetch_add(&sink.duplicated, 1, __ATOMIC_RELAXED);
+    }
+    else{
+        SET_BIT(seq);
+        __atomic_fetch_add(&sink.reordered, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sink.unique, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void* sink_loop(void* arg){
+    int sockfd = *(int*) arg;
+    struct mmsghdr msgs[BATCH];
+    struct iovec iovecs[BATCH];
+    char* bufs = malloc(BATCH * MAX_DATAGRAM);
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH; i++){
+        iovecs[i].iov_base = bufs + i * MAX_DATAGRAM;
+        iovecs[i].iov_len = MAX_DATAGRAM;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (1){
+        if (wait_mode != WAIT_BLOCK && wait_ready(&pfd, 1, -1) <= 0){ continue; }
+        int n = recvmmsg(sockfd, msgs, BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0){
+            if (errno == EINTR){ continue; }
+            fprintf(stderr, "[ERROR] recvmmsg() failed to receive data.\n");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++){
+            traffic_header* hdr = iovecs[i].iov_base;
+            if (msgs[i].msg_len < sizeof(traffic_header) || hdr->magic != TRAFFIC_MAGIC){ continue; }
+            __atomic_fetch_add(&sink.received, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&sink.bytes, msgs[i].msg_len, __ATOMIC_RELAXED);
+            count_packet(hdr);
+        }
+    }
+    return NULL;
+}
+
+void run_sink(int sockfd){
+    pthread_t thread;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &(int) {SINK_RCVBUF}, sizeof(int));  // absorb bursts
+    pthread_create(&thread, NULL, sink_loop, &sockfd);
+    fprintf(stderr, "[INFO] Counting generated datagrams.\n");
+
+    // Report once per second while there is traffic. Lost is the change in missing
+    // packets, so late arrivals filling earlier gaps can make it negative
+    sink_stats last = {0};
+    while (1){
+        sleep(1);
+        sink_stats now;
+        now.received = __atomic_load_n(&sink.received, __ATOMIC_RELAXED);
+        now.expected = __atomic_load_n(&sink.expected, __ATOMIC_RELAXED);
+        now.unique = __atomic_load_n(&sink.unique, __ATOMIC_RELAXED);
+        now.duplicated = __atomic_load_n(&sink.duplicated, __ATOMIC_RELAXED);
+        now.reordered = __atomic_load_n(&sink.reordered, __ATOMIC_RELAXED);
+        now.bytes = __atomic_load_n(&sink.bytes, __ATOMIC_RELAXED);
+        if (now.received != last.received){
+            int64_t lost = (int64_t) (now.expected - now.unique) - (int64_t) (last.expected - last.unique);
+            fprintf(stderr, "[INFO] %lu packets/s received (%.1f Mbit/s), %ld lost, %lu duplicated, %lu reordered\n",
+                    now.received - last.received, (now.bytes - last.bytes) * 8 / 1e6, lost,
+                    now.duplicated - last.duplicated, now.reordered - last.reordered);
+        }
+        last = now;
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <stdint.h>
+
+// Header at the start of every generated datagram; the rest is padding
+typedef struct {
+    uint32_t magic;  // TRAFFIC_MAGIC, to ignore unrelated datagrams
+    uint32_t run;    // Random per generator run, so a restarted generator resets the sink
+    uint32_t flow;   // Sender thread
+    uint32_t unused;
+    uint64_t seq;    // Per-flow packet number, from 0
+} traffic_header;
+
+#define TRAFFIC_MAGIC 0x47454e31 // "GEN1"
+#define MAX_FLOWS 64             // Sender threads per generator (and flows tracked by the sink)
+
+// Send size-byte datagrams from n_threads threads for duration seconds at a total
+// of rate packets/s (0: as fast as possible), reporting the send rate every second
+void run_generator(struct sockaddr_in* serveraddr, int n_threads, double rate, int size, int duration);
+
+// Count generated datagrams on sockfd and report received, lost, duplicated and
+// reordered packets every second; never returns
+void run_sink(int sockfd);
@@ -0,0 +1,65 @@
+#define _GNU_SOURCE // ppoll(), sched_setaffinity()
+#include "wait.h"
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+int wait_mode = WAIT_BLOCK;
+
+static int64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int set_wait_mode(const char* name){
+    if (strcmp(name, "block") == 0){ wait_mode = WAIT_BLOCK; }
+    else if (strcmp(name, "spin") == 0){ wait_mode = WAIT_SPIN; }
+    else if (strcmp(name, "busy") == 0){ wait_mode = WAIT_BUSY; }
+    else{ return -1; }
+    return 0;
+}
+
+void tune_socket(int sockfd){
+    if (wait_mode != WAIT_BUSY){ return; }
+    // Let blocking receives and poll() spin on the device queue instead of waiting for an interrupt.
+    // Values above net.core.busy_read need CAP_NET_ADMIN; without it the spin below still helps
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &(int) {BUSY_POLL_US}, sizeof(int)) < 0){
+        fprintf(stderr, "[INFO] SO_BUSY_POLL not permitted; spinning in user space only.\n");
+    }
+}
+
+void pin_cpu(int cpu){
+    if (cpu < 0){ return; }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0){  // 0: the calling thread
+        fprintf(stderr, "[ERROR] Fail to pin thread to CPU %d.\n", cpu);
+    }
+}
+
+int wait_ready(struct pollfd* fds, int nfds, int64_t timeout_ns){
+    int64_t deadline = timeout_ns < 0 ? -1 : now_ns() + timeout_ns;
+
+    // Spin with zero-timeout polls: forever in spin mode, for a bounded time in busy mode
+    if (wait_mode != WAIT_BLOCK){
+        int64_t spin_end = wait_mode == WAIT_SPIN ? deadline : now_ns() + BUSY_SPIN_NS;
+        if (deadline >= 0 && spin_end > deadline){ spin_end = deadline; }
+        while (1){
+            int ready = poll(fds, nfds, 0);
+            if (ready != 0){ return ready; }
+            if (spin_end >= 0 && now_ns() >= spin_end){ break; }
+        }
+        if (wait_mode == WAIT_SPIN || (deadline >= 0 && now_ns() >= deadline)){ return 0; }
+    }
+
+    // Sleep until ready or the deadline
+    if (deadline < 0){ return ppoll(fds, nfds, NULL, NULL); }
+    int64_t left = deadline - now_ns();
+    if (left < 0){ left = 0; }
+    struct timespec timeout = {left / 1000000000LL, left % 1000000000LL};
+    return ppoll(fds, nfds, &timeout, NULL);
+}
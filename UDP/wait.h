@@ -0,0 +1,26 @@
+#pragma once
+
+#include <poll.h>
+#include <stdint.h>
+
+// How the echo loops wait for a socket or STDIN to become ready
+#define WAIT_BLOCK 0 // Sleep in poll() until something is ready (default, no idle CPU)
+#define WAIT_SPIN 1  // Never sleep: keep polling with a zero timeout (one full core)
+#define WAIT_BUSY 2  // Spin for up to BUSY_SPIN_NS, then sleep; with SO_BUSY_POLL and pinning
+
+#define BUSY_SPIN_NS 200000 // How long busy mode spins before falling back to poll()
+#define BUSY_POLL_US 50     // SO_BUSY_POLL budget: how long the kernel polls the NIC queue
+
+extern int wait_mode;
+
+// Select the wait mode by name ("block", "spin" or "busy"); returns -1 if unknown
+int set_wait_mode(const char* name);
+
+// Apply the per-socket part of the wait mode (SO_BUSY_POLL in busy mode)
+void tune_socket(int sockfd);
+
+// Pin the calling thread to a CPU; does nothing for cpu < 0
+void pin_cpu(int cpu);
+
+// Wait until one of fds is ready or timeout_ns passes (-1: no timeout); returns like poll()
+int wait_ready(struct pollfd* fds, int nfds, int64_t timeout_ns);